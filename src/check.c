@@ -0,0 +1,374 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "libmqtt.h"
+#include "libmqttcache.h"
+#include "libmqttws.h"
+
+/**
+ * 自检程序 (make check), 不需要服务器, 检查库中容易出错的部分:
+ * topic 和 UTF-8 校验, LZ4 编解码往返, WebSocket 握手的 Sec-WebSocket-Accept, 最新值缓存的无锁读取,
+ * WebSocket 传输层对照本机的模拟服务器收发帧 (分片, 控制帧, 违反协议的帧)
+ * 全部通过时返回 0
+ */
+
+static int failed;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed++; \
+        } \
+    } while(0)
+
+static int topicOk(const char *topic, uint8_t filter)
+{
+    return mqttCheckTopic((const uint8_t*)topic, strlen(topic), filter);
+}
+
+static void checkTopic(void)
+{
+    char longTopic[100];
+
+    CHECK(topicOk("a/b/c", 0));
+    CHECK(topicOk("/", 0));
+    CHECK(topicOk("\xE4\xB8\xAD\xE6\x96\x87/\xF0\x9F\x98\x80", 0)); // 中文 和 U+1F600
+    CHECK(!topicOk("", 0));
+    CHECK(!topicOk("a/+", 0));
+    CHECK(!topicOk("a/#", 0));
+    CHECK(!mqttCheckTopic((const uint8_t*)"a\0b", 3, 0));  // U+0000
+    CHECK(!topicOk("a\xC0\xAF", 0));                      // 超长编码
+    CHECK(!topicOk("a\xED\xA0\x80", 0));                  // 代理项 U+D800
+    CHECK(!topicOk("a\xF4\x90\x80\x80", 0));              // 超过 U+10FFFF
+    CHECK(!topicOk("a\xE4\xB8", 0));                      // 截断的多字节字符
+    CHECK(!topicOk("a\x80", 0));                          // 单独的后续字节
+
+    CHECK(topicOk("#", 1));
+    CHECK(topicOk("+", 1));
+    CHECK(topicOk("a/+/c/#", 1));
+    CHECK(topicOk("+/+", 1));
+    CHECK(!topicOk("a/#/c", 1));
+    CHECK(!topicOk("a#", 1));
+    CHECK(!topicOk("a/b+", 1));
+    CHECK(!topicOk("+a", 1));
+
+    // 长于一个向量的 ASCII 段, 非法字节在向量之后
+    memset(longTopic, 'x', sizeof(longTopic));
+    CHECK(mqttCheckTopic((const uint8_t*)longTopic, sizeof(longTopic), 0));
+    longTopic[sizeof(longTopic) - 1] = '+';
+    CHECK(!mqttCheckTopic((const uint8_t*)longTopic, sizeof(longTopic), 0));
+    CHECK(mqttCheckTopic((const uint8_t*)longTopic, sizeof(longTopic) - 1, 0));
+}
+
+static void checkLz4(void)
+{
+    static MqttLz4 lz4;
+    static uint8_t in[70000], enc[71000], dec[70000];
+    const uint32_t lens[] = {13, 100, 4096, 65536 + 100, sizeof(in)};
+    uint32_t i, j, seed = 1;
+    int32_t encLen, decLen;
+
+    for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    {
+        // 前一半是重复的文本 (长匹配, 长度超过 15 + 255), 后一半是随机数据 (长字面量)
+        for(j = 0; j < lens[i]; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            in[j] = (j < lens[i] / 2) ? (uint8_t)"mqtt/topic/"[j % 11] : (uint8_t)(seed >> 16);
+        }
+        encLen = mqttLz4Encode(&lz4, in, lens[i], enc, sizeof(enc));
+        CHECK(encLen > 0);
+        if(encLen <= 0)
+            continue;
+        decLen = mqttLz4Decode(NULL, enc, encLen, dec, sizeof(dec));
+        CHECK(decLen == (int32_t)lens[i] && !memcmp(in, dec, lens[i]));
+        // 输出缓冲区太小, 截断的输入
+        CHECK(mqttLz4Decode(NULL, enc, encLen, dec, lens[i] - 1) < 0);
+        CHECK(mqttLz4Decode(NULL, enc, encLen - 1, dec, sizeof(dec)) != (int32_t)lens[i]);
+    }
+    // 放不进 cap 时返回 0
+    CHECK(mqttLz4Encode(&lz4, in, sizeof(in), enc, 100) == 0);
+}
+
+static void checkWsAccept(void)
+{
+    char accept[29];
+
+    // RFC 6455 1.3 的例子
+    mqttWsAccept("dGhlIHNhbXBsZSBub25jZQ==", accept);
+    CHECK(!strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+}
+
+/**
+ * 模拟的 WebSocket 服务器: 完成握手后发送 frames, 然后接收客户端的帧 (去掉掩码) 直到连接关闭
+ */
+typedef struct
+{
+    SOCKET listen;
+    const uint8_t *frames;
+    uint32_t framesLen;
+    uint8_t recv[64];    // 客户端发来的帧头 (不含掩码密钥) 和负载
+    uint32_t recvLen;
+} WsServer;
+
+static int recvAll(SOCKET s, void *data, int len)
+{
+    int ret, total;
+
+    for(total = 0; total < len; total += ret)
+    {
+        if((ret = recv(s, (char*)data + total, len - total, 0)) <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void *wsServer(void *param)
+{
+    WsServer *server = param;
+    char buf[1024], acceptKey[29], *key;
+    uint8_t head[2], mask[4], payload[125];
+    SOCKET s;
+    int len, i;
+
+    s = accept(server->listen, NULL, NULL);
+    if(INVALID_SOCKET == s)
+        return NULL;
+    for(len = 0; len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4); len++)
+    {
+        if(len >= (int)sizeof(buf) - 1 || recv(s, buf + len, 1, 0) <= 0)
+            goto exit;
+    }
+    buf[len] = 0;
+    if(!(key = strstr(buf, "Sec-WebSocket-Key: ")))
+        goto exit;
+    key += 19;
+    mqttWsAccept(key, acceptKey);
+    len = sprintf(buf, "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: %s\r\n"
+                       "Sec-WebSocket-Protocol: mqtt\r\n\r\n", acceptKey);
+    send(s, buf, len, 0);
+    send(s, (const char*)server->frames, server->framesLen, 0);
+    // 客户端的帧都短于 126 字节
+    while(!recvAll(s, head, 2) && !recvAll(s, mask, 4) && !recvAll(s, payload, head[1] & 0x7F))
+    {
+        len = head[1] & 0x7F;
+        if(server->recvLen + 2 + len > sizeof(server->recv))
+            break;
+        server->recv[server->recvLen++] = head[0];
+        server->recv[server->recvLen++] = head[1];
+        for(i = 0; i < len; i++)
+            server->recv[server->recvLen++] = payload[i] ^ mask[i & 3];
+    }
+exit:
+    closesocket(s);
+    return NULL;
+}
+
+// 直接收发 socket 的下层传输层, 代替 TLS 检查 MqttWs.lower
+static int32_t plainSend(void *conn, const void *data, unsigned int len)
+{
+    return send((SOCKET)conn, (const char*)data, len, 0);
+}
+
+static int32_t plainRecv(void *conn, void *data, unsigned int len)
+{
+    return recv((SOCKET)conn, (char*)data, len, 0);
+}
+
+static const MqttTransport plainTransport = {plainSend, plainRecv, NULL};
+
+/**
+ * @brief   连接模拟服务器, 完成握手后接收 len 字节, 然后发送 "abc" 并关闭连接
+ * @param   lower [in] 下层传输层, NULL 时直接收发 socket
+ * @param   frames [in] 服务器在握手后发送的帧
+ * @param   data [out] 收到的负载
+ * @param   server [out] 服务器收到的帧
+ * @return  最后一次 recv 的返回值, 连接或握手失败时返回 -100
+ */
+static int32_t wsExchange(const MqttTransport *lower, const uint8_t *frames, uint32_t framesLen, \
+                          uint8_t *data, uint32_t len, WsServer *server)
+{
+    struct sockaddr_in addr;
+    int addrLen = sizeof(addr);
+    CRITICAL_SECTION lock;
+    pthread_t thread;
+    MqttWs ws;
+    SOCKET s;
+    uint32_t got = 0;
+    int32_t ret = -100;
+
+    memset(server, 0, sizeof(*server));
+    server->frames = frames;
+    server->framesLen = framesLen;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server->listen = socket(AF_INET, SOCK_STREAM, 0);
+    bind(server->listen, (SOCKADDR*)&addr, sizeof(addr));
+    listen(server->listen, 1);
+    getsockname(server->listen, (SOCKADDR*)&addr, &addrLen);
+    pthread_create(&thread, NULL, wsServer, server);
+
+    InitializeCriticalSection(&lock);
+    memset(&ws, 0, sizeof(ws));
+    ws.sendLock = &lock;
+    s = socket(AF_INET, SOCK_STREAM, 0);
+    ws.lower = lower;
+    ws.lowerConn = (void*)s;
+    if(!connect(s, (SOCKADDR*)&addr, sizeof(addr)) && MQTT_OK == mqttWsConnect(&ws, (void*)s, "127.0.0.1", "/mqtt"))
+    {
+        while(got < len && (ret = mqttWsTransport.recv(&ws, data + got, len - got)) > 0)
+            got += ret;
+        mqttWsTransport.send(&ws, "abc", 3);
+    }
+    shutdown(s, SD_BOTH);
+    closesocket(s);
+    pthread_join(thread, NULL);
+    closesocket(server->listen);
+    DeleteCriticalSection(&lock);
+    return ret;
+}
+
+static void checkWs(void)
+{
+    // 分片的二进制消息 "hel" + "lo", 中间插入 PING
+    static const uint8_t fragmented[] = {0x02, 3, 'h', 'e', 'l', 0x89, 1, 'p', 0x80, 2, 'l', 'o'};
+    static const uint8_t rsv[] = {0xC2, 1, 'x'};                 // RSV1
+    static const uint8_t ctrlFragment[] = {0x09, 0, 0x82, 1, 'x'}; // 没有 FIN 的 PING
+    static const uint8_t orphan[] = {0x80, 1, 'x'};              // 没有开头的 CONTINUATION
+    static const uint8_t interleaved[] = {0x02, 1, 'a', 0x82, 1, 'b'}; // 上一个消息没收完就开始新消息
+    static const uint8_t text[] = {0x81, 1, 'x'};                // MQTT 只使用二进制帧
+    // 客户端应答 PONG, 然后发送 "abc"
+    static const uint8_t expect[] = {0x8A, 0x81, 'p', 0x82, 0x83, 'a', 'b', 'c'};
+    WsServer server;
+    uint8_t data[8];
+
+    CHECK(wsExchange(NULL, fragmented, sizeof(fragmented), data, 5, &server) > 0 && !memcmp(data, "hello", 5));
+    CHECK(server.recvLen == sizeof(expect) && !memcmp(server.recv, expect, sizeof(expect)));
+    CHECK(wsExchange(NULL, rsv, sizeof(rsv), data, 1, &server) == -1);
+    CHECK(wsExchange(NULL, ctrlFragment, sizeof(ctrlFragment), data, 1, &server) == -1);
+    CHECK(wsExchange(NULL, orphan, sizeof(orphan), data, 1, &server) == -1);
+    CHECK(wsExchange(NULL, interleaved, sizeof(interleaved), data, 2, &server) == -1 && data[0] == 'a');
+    CHECK(wsExchange(NULL, text, sizeof(text), data, 1, &server) == -1);
+    // 经由下层传输层收发
+    CHECK(wsExchange(&plainTransport, fragmented, sizeof(fragmented), data, 5, &server) > 0 && !memcmp(data, "hello", 5));
+    CHECK(server.recvLen == sizeof(expect) && !memcmp(server.recv, expect, sizeof(expect)));
+    CHECK(wsExchange(&plainTransport, orphan, sizeof(orphan), data, 1, &server) == -1);
+}
+
+/**
+ * @brief   组装 QoS 0 的 PUBLISH 报文, 负载每个字节都等于 fill
+ * @return  报文长度
+ */
+static uint32_t publishPacket(uint8_t *buf, const char *topic, uint8_t fill, uint32_t len)
+{
+    uint32_t topicLen = strlen(topic), remain = 2 + topicLen + len, n = 1;
+
+    buf[0] = MQTT_MSG_PUBLISH;
+    do {
+        buf[n] = remain & 0x7F;
+        remain >>= 7;
+        if(remain)
+            buf[n] |= 0x80;
+        n++;
+    } while(remain);
+    buf[n++] = topicLen >> 8;
+    buf[n++] = topicLen & 0xFF;
+    memcpy(buf + n, topic, topicLen);
+    n += topicLen;
+    memset(buf + n, fill, len);
+    return n + len;
+}
+
+static MqttCache *cache;
+static volatile int cacheStop;
+
+// 更新线程: 负载长度和内容都随次数变化, 读到长度与内容不一致说明读到了改写中的数据
+static void *cacheWriter(void *param)
+{
+    uint8_t buf[300];
+    uint32_t i;
+
+    (void)param;
+    for(i = 0; i < 200000; i++)
+    {
+        publishPacket(buf, "c/d", i & 0xFF, 1 + (i & 0xFF));
+        mqttCacheUpdate(cache, buf);
+    }
+    cacheStop = 1;
+    return NULL;
+}
+
+static void checkCache(void)
+{
+    uint8_t buf[300];
+    MqttCacheView view, stale;
+    pthread_t writer;
+    uint32_t i, torn = 0, valid = 0;
+
+    cache = mqttCacheCreate(16, 1 << 16);
+    CHECK(cache != NULL);
+    if(!cache)
+        return;
+    CHECK(!mqttCacheLookup(cache, (const uint8_t*)"a/b", 3, &view));
+    publishPacket(buf, "a/b", 1, 10);
+    mqttCacheUpdate(cache, buf);
+    CHECK(mqttCacheLookup(cache, (const uint8_t*)"a/b", 3, &stale));
+    CHECK(stale.len == 10 && stale.data[0] == 1);
+    // 两块缓冲区轮流写入: 下一次更新不改写正在读的值, 再下一次才改写
+    publishPacket(buf, "a/b", 2, 10);
+    mqttCacheUpdate(cache, buf);
+    CHECK(mqttCacheValidate(&stale) && stale.data[0] == 1);
+    CHECK(mqttCacheLookup(cache, (const uint8_t*)"a/b", 3, &view) && view.data[0] == 2);
+    publishPacket(buf, "a/b", 3, 10);
+    mqttCacheUpdate(cache, buf);
+    CHECK(!mqttCacheValidate(&stale));
+
+    // 与更新线程并发读取
+    publishPacket(buf, "c/d", 0, 1);
+    mqttCacheUpdate(cache, buf);
+    pthread_create(&writer, NULL, cacheWriter, NULL);
+    while(!cacheStop)
+    {
+        if(!mqttCacheLookup(cache, (const uint8_t*)"c/d", 3, &view))
+            continue;
+        memcpy(buf, view.data, view.len);
+        if(!mqttCacheValidate(&view))
+            continue;
+        valid++;
+        for(i = 0; i < view.len; i++)
+        {
+            if(buf[i] != (uint8_t)(view.len - 1))
+            {
+                torn++;
+                break;
+            }
+        }
+    }
+    pthread_join(writer, NULL);
+    CHECK(valid > 0 && !torn);
+    mqttCacheDestroy(cache);
+}
+
+int main(void)
+{
+    WSADATA wsaData;
+
+    if(WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        return -1;
+    checkTopic();
+    checkLz4();
+    checkWsAccept();
+    checkWs();
+    checkCache();
+    WSACleanup();
+    printf("%s\n", failed ? "FAILED" : "OK");
+    return failed ? 1 : 0;
+}
@@ -1,12 +1,31 @@
 #include <string.h>
 #include <stdlib.h>
 #include "libmqtt.h"
+#include "libmqttcap.h"
+#include "libmqtttrace.h"
 
-// 以下 4 个函数是平台相关的底层 I/O 接口
+// 以下函数是平台相关的底层 I/O 接口
 extern int32_t mqttSend(void *socket, const void *data, unsigned int len);
 extern int32_t mqttRecv(void *socket, void *data, unsigned int len);
+extern int32_t mqttSendNow(void *socket, const void *data, unsigned int len);
+extern int mqttWaitSocket(void *socket, uint8_t write, unsigned int time);
+extern uint64_t mqttTimeUs(void);
 extern int mqttWaitAck(MqttBroker *broker, unsigned int time);
 extern void mqttWakeUp(MqttBroker *broker);
+extern void mqttLock(void *lock);
+extern void mqttUnlock(void *lock);
+extern void mqttFlowLock(MqttFlow *flow);
+extern void mqttFlowUnlock(MqttFlow *flow);
+extern void mqttFlowWait(MqttFlow *flow);
+extern void mqttFlowWake(MqttFlow *flow);
+
+// 负载编解码, 见 libmqttcodec.c
+extern uint32_t mqttCodecEncode(MqttCodecChain *chain, const uint8_t *msg, uint32_t len, \
+                                uint8_t *head, uint32_t *headLen, const uint8_t **body);
+extern int32_t mqttCodecDecode(MqttCodecChain *chain, const uint8_t *in, uint32_t len, uint32_t prefix, uint8_t **out);
+
+// 最新值缓存, 见 libmqttcache.c
+extern void mqttCacheUpdate(struct MqttCache *cache, const uint8_t *recvBuf);
 
 #define MQTT_DUP_FLAG       (1 << 3)
 #define MQTT_QOS0_FLAG      (0 << 1)
@@ -19,6 +38,100 @@ extern void mqttWakeUp(MqttBroker *broker);
 #define MQTT_USERNAME_FLAG  (1 << 7)
 #define MQTT_PASSWORD_FLAG  (1 << 6)
 
+// MQTT 5.0 属性标识符
+#define MQTT_PROP_RECV_MAX    0x21
+#define MQTT_PROP_ALIAS_MAX   0x22
+#define MQTT_PROP_ALIAS       0x23
+#define MQTT_PROP_MAX_PACKET  0x27
+
+/**
+ * @brief   设置期望的应答, mqttThread 收到后清零 waitType 并唤醒等待的线程
+ * @param   broker [in] broker 指针
+ * @param   type [in] 应答类型
+ * @param   param [in] 消息 ID
+ */
+static void waitSet(MqttBroker *broker, uint8_t type, uint16_t param)
+{
+    mqttLock(broker->criticalSection);
+    broker->waitType = type;
+    broker->waitParam = param;
+    mqttUnlock(broker->criticalSection);
+}
+
+/**
+ * @brief   等待 broker->waitType 指定的应答, 记录等待的时间
+ * @param   broker [in] broker 指针
+ * @return  1 收到期望的应答, 0 超时
+ * @note    在锁内检查 waitType 再等待, 应答在发送之后, 等待之前到达时不会丢失唤醒
+ */
+static int waitAck(MqttBroker *broker)
+{
+    uint64_t deadline = mqttTimeUs() + MQTT_TIMEOUE * 1000ull, now;
+    uint8_t type;
+    uint16_t msgID;
+    int ret;
+
+    mqttLock(broker->criticalSection);
+    type = broker->waitType;
+    msgID = broker->waitParam;
+    MQTT_TRACE(broker, MQTT_STAGE_WAIT | MQTT_TRACE_BEGIN, type, msgID, 0);
+    while(broker->waitType && (now = mqttTimeUs()) < deadline)
+        mqttWaitAck(broker, (deadline - now + 999) / 1000);
+    ret = !broker->waitType;
+    MQTT_TRACE(broker, MQTT_STAGE_WAIT | MQTT_TRACE_END, type, msgID, 0);
+    mqttUnlock(broker->criticalSection);
+    return ret;
+}
+
+/**
+ * @brief   发送数据, 设置了 broker->transport 时经由传输层发送, 否则直接发送到 socket
+ * @param   broker [in] broker 指针
+ * @param   data [in] 数据
+ * @param   len [in] 数据长度
+ * @return  已发送的字节数, < 0 发送错误
+ */
+static int32_t brokerSend(MqttBroker *broker, const void *data, unsigned int len)
+{
+    int32_t ret;
+
+    if(broker->sendLock)
+        mqttLock(broker->sendLock);
+    if(broker->transport)
+        ret = broker->transport->send(broker->conn, data, len);
+    else
+        ret = mqttSend(broker->socket, data, len);
+    if(broker->capture && ret > 0)
+        mqttCapture(broker->capture, broker, MQTT_CAP_OUT, data, ret);
+    if(broker->sendLock)
+        mqttUnlock(broker->sendLock);
+    return ret;
+}
+
+/**
+ * @brief   接收数据, 设置了 broker->transport 时经由传输层接收, 否则直接从 socket 接收
+ * @param   broker [in] broker 指针
+ * @param   data [out] 数据缓冲区
+ * @param   len [in] 缓冲区长度
+ * @return  已接收的字节数, 0 连接已关闭, MQTT_RECV_AGAIN 暂时没有数据 (只在 broker->nonblock 时), 其它 < 0 接收错误
+ * @note    阻塞模式下传输层也可能返回 MQTT_RECV_AGAIN (如 TLS 内部使用非阻塞 socket), 此时等到 socket 可读再接收
+ */
+static int32_t brokerRecv(MqttBroker *broker, void *data, unsigned int len)
+{
+    int32_t ret;
+
+    for(;;)
+    {
+        if(broker->transport)
+            ret = broker->transport->recv(broker->conn, data, len);
+        else
+            ret = mqttRecv(broker->socket, data, len);
+        if(MQTT_RECV_AGAIN != ret || broker->nonblock)
+            return ret;
+        if(mqttWaitSocket(broker->socket, 0, MQTT_TIMEOUE) < 0)
+            return -1;
+    }
+}
+
 /**
  * @brief   解析数据包 长度字段中 剩余的字节数
  * @param   buf [in] 指向数据包的指针
@@ -39,7 +152,7 @@ static uint8_t sizeofLenth(const uint8_t *buf)
  */
 static int32_t remainLenth(const uint8_t *buf)
 {
-    uint16_t multiplier = 1;
+    int32_t multiplier = 1;
     int32_t value = 0;
     uint8_t digit;
 
@@ -109,6 +222,399 @@ static void packetWrite(uint8_t *buf, int32_t *offset, const void *data, uint16_
     (*offset) += lenth;
 }
 
+/**
+ * @brief   计算并检查 topic 长度
+ * @param   topic [in] topic 字符串
+ * @param   filter [in] 0 topic 名称, 1 topic 过滤器
+ * @return  topic 长度, topic 不合法时返回 -1
+ */
+static int32_t topicLenth(const char *topic, uint8_t filter)
+{
+    size_t len = strlen(topic);
+
+    if(len > 0xFFFF || !mqttCheckTopic((const uint8_t*)topic, len, filter))
+        return -1;
+    return len;
+}
+
+/**
+ * @brief   检查收到的 PUBLISH 报文: QoS, topic 长度是否越界, topic 是否合法
+ * @param   buf [in] 指向数据包的指针
+ * @return  1 合法, 0 非法
+ */
+static int publishCheck(const uint8_t *buf)
+{
+    const uint8_t *topic;
+    int32_t remain = remainLenth(buf);
+    uint16_t topiclen;
+
+    if(MQTTParseMessageQos(buf) == 3 || remain < 2)
+        return 0;
+    topiclen = mqttGetTopic(buf, &topic);
+    if(2 + topiclen + (MQTTParseMessageQos(buf) ? 2 : 0) > remain)
+        return 0;
+    return mqttCheckTopic(topic, topiclen, 0);
+}
+
+/**
+ * @brief   解析变长字节整数
+ * @param   buf [in] 数据
+ * @param   len [in] 数据长度
+ * @param   value [out] 整数值
+ * @return  占用的字节数, 0 = 格式错误
+ */
+static uint32_t varintDecode(const uint8_t *buf, uint32_t len, uint32_t *value)
+{
+    uint32_t i;
+
+    *value = 0;
+    for(i = 0; i < len && i < 4; i++)
+    {
+        *value |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+        if(!(buf[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   解析一个 MQTT 5.0 属性
+ * @param   buf [in] 属性起始位置
+ * @param   len [in] 属性区剩余长度
+ * @param   id [out] 属性标识符
+ * @param   value [out] 整数类型属性的值, 其它类型为 0
+ * @return  属性占用的字节数, 0 = 格式错误或未知属性
+ */
+static uint32_t propNext(const uint8_t *buf, uint32_t len, uint8_t *id, uint32_t *value)
+{
+    uint32_t n, i, numeric = 1;
+
+    if(!len)
+        return 0;
+    *id = buf[0];
+    *value = 0;
+    switch(buf[0])
+    {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+        n = 1; // 单字节
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        n = 2; // 双字节整数
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        n = 4; // 四字节整数
+        break;
+    case 0x0B:
+        n = varintDecode(buf + 1, len - 1, value); // 订阅标识符
+        return n ? n + 1 : 0;
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+        // UTF-8 字符串或二进制数据
+        if(len < 3)
+            return 0;
+        n = 2 + (buf[1] << 8 | buf[2]);
+        numeric = 0;
+        break;
+    case 0x26:
+        // 用户属性, 字符串对
+        if(len < 3)
+            return 0;
+        n = 2 + (buf[1] << 8 | buf[2]);
+        if(len < 1 + n + 2)
+            return 0;
+        n += 2 + (buf[1 + n] << 8 | buf[2 + n]);
+        numeric = 0;
+        break;
+    default:
+        return 0;
+    }
+    if(1 + n > len)
+        return 0;
+    for(i = 1; numeric && i <= n; i++)
+        *value = (*value << 8) | buf[i];
+    return 1 + n;
+}
+
+/**
+ * @brief   解析 MQTT 5.0 应答报文中的原因码
+ * @param   buf [in] 指向数据包的指针
+ * @return  原因码, 报文中省略时为 0 (成功)
+ */
+static uint8_t reason5(const uint8_t *buf)
+{
+    uint8_t rlb = sizeofLenth(buf);
+    uint32_t remain = remainLenth(buf);
+    uint32_t propLen, n;
+
+    switch(MQTTParseMessageType(buf))
+    {
+    case MQTT_MSG_CONNACK:
+        return (remain >= 2) ? buf[1 + rlb + 1] : 0x80; // 格式错误按 Unspecified error 处理
+    case MQTT_MSG_PUBACK: case MQTT_MSG_PUBREC: case MQTT_MSG_PUBREL: case MQTT_MSG_PUBCOMP:
+    case MQTT_MSG_DISCONNECT:
+        // 剩余长度为 2 (DISCONNECT 为 0) 时省略原因码
+        if(MQTTParseMessageType(buf) == MQTT_MSG_DISCONNECT)
+            return remain ? buf[1 + rlb] : 0;
+        return (remain >= 3) ? buf[1 + rlb + 2] : 0;
+    case MQTT_MSG_SUBACK: case MQTT_MSG_UNSUBACK:
+        // [ID 2 字节][属性长度][属性][原因码...], 只取第一个原因码
+        if(remain < 3 || !(n = varintDecode(buf + 1 + rlb + 2, remain - 2, &propLen)))
+            return 0;
+        if(2 + n + propLen >= remain)
+            return 0;
+        return buf[1 + rlb + 2 + n + propLen];
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief   把 MQTT 5.0 的 CONNACK 原因码转换成 MqttRet
+ * @param   reason [in] 原因码
+ * @return  参考 MqttRet
+ */
+static MqttRet connackRet5(uint8_t reason)
+{
+    switch(reason)
+    {
+    case 0x00: return MQTT_OK;
+    case 0x84: return MQTT_VERSION_ERR;    // Unsupported Protocol Version
+    case 0x85: return MQTT_ID_ERR;         // Client Identifier not valid
+    case 0x86: return MQTT_PASSWORD_ERR;   // Bad User Name or Password
+    case 0x87: return MQTT_PERMISSION_ERR; // Not authorized
+    case 0x88: case 0x89: return MQTT_SERVER_ERR; // Server unavailable, Server busy
+    case 0x95: return MQTT_SIZE_ERR;       // Packet too large
+    default:   return MQTT_REASON_ERR;
+    }
+}
+
+/**
+ * @brief   解析 MQTT 5.0 CONNACK 属性, 记录服务器的流控参数
+ * @param   broker [in] broker 指针
+ * @param   buf [in] 指向 CONNACK 数据包的指针
+ */
+static void connack5(MqttBroker *broker, const uint8_t *buf)
+{
+    MqttV5 *v5 = broker->v5;
+    uint8_t rlb = sizeofLenth(buf);
+    uint32_t remain = remainLenth(buf);
+    uint32_t pos, end, propLen, value, n;
+    uint8_t id;
+
+    // 协议默认值
+    v5->serverRecvMax = 65535;
+    v5->serverMaxPacket = 0;
+    v5->serverAliasMax = 0;
+    pos = 1 + rlb + 2; // 跳过确认标志和原因码
+    end = 1 + rlb + remain;
+    if(pos >= end || !(n = varintDecode(buf + pos, end - pos, &propLen)))
+        return;
+    pos += n;
+    if(propLen < end - pos)
+        end = pos + propLen;
+    for(; pos < end && (n = propNext(buf + pos, end - pos, &id, &value)); pos += n)
+    {
+        if(MQTT_PROP_RECV_MAX == id)
+            v5->serverRecvMax = value;
+        else if(MQTT_PROP_MAX_PACKET == id)
+            v5->serverMaxPacket = value;
+        else if(MQTT_PROP_ALIAS_MAX == id)
+            v5->serverAliasMax = value;
+    }
+}
+
+/**
+ * @brief   在负载之前构造 3.1.1 格式的 PUBLISH 报文头 [固定头][topic 长度][topic][ID],
+ *          从后往前写, topic 和 ID 可以与目标区域重叠 (目标不在源数据之前)
+ * @param   flags [in] 固定头第 1 字节
+ * @param   topic [in] topic
+ * @param   topicLen [in] topic 长度
+ * @param   id [in] 消息 ID (2 字节), QoS 0 时为 NULL
+ * @param   payload [in] 负载, 位置不变
+ * @param   payloadLen [in] 负载长度
+ * @return  报文起始位置
+ * @warning payload 之前必须有 1 + 4 + 2 + topicLen + 2 字节的可写空间 (剩余长度越短, 实际用到的越少)
+ */
+static uint8_t *publishBuild(uint8_t flags, const uint8_t *topic, uint32_t topicLen, const uint8_t *id, \
+                             uint8_t *payload, uint32_t payloadLen)
+{
+    uint32_t idLen = id ? 2 : 0;
+    uint32_t remain = 2 + topicLen + idLen + payloadLen;
+    uint32_t n, i;
+    uint8_t *start;
+
+    for(n = 1, i = remain >> 7; i; i >>= 7)
+        n++;
+    start = payload - (1 + n + 2 + topicLen + idLen);
+    if(id)
+        memmove(payload - idLen, id, idLen);
+    memmove(start + 1 + n + 2, topic, topicLen);
+    start[1 + n] = topicLen >> 8;
+    start[1 + n + 1] = topicLen & 0xFF;
+    start[0] = flags;
+    for(i = 1; i <= n; i++, remain >>= 7)
+        start[i] = (remain & 0x7F) | ((i < n) ? 0x80 : 0);
+    return start;
+}
+
+/**
+ * @brief   解码收到的 PUBLISH 负载 (见 MqttCodecChain), 解码结果重新组成 3.1.1 格式的报文
+ * @param   broker [in] broker 指针
+ * @return  0 成功, -1 负载格式错误或内存不足
+ * @warning 成功后 broker->recvBuf 指向重组的报文 (未编码时仍在原缓冲区内, 否则在编解码缓冲区内)
+ */
+static int publishDecode(MqttBroker *broker)
+{
+    uint8_t *buf = broker->recvBuf;
+    const uint8_t *topic, *msg;
+    uint16_t topicLen = mqttGetTopic(buf, &topic);
+    int32_t msgLen = mqttGetMsg(buf, &msg);
+    uint8_t *payload;
+    int32_t len;
+
+    len = mqttCodecDecode(broker->codec, msg, msgLen, 1 + 4 + 2 + topicLen + 2, &payload);
+    if(len < 0)
+        return -1;
+    broker->recvBuf = publishBuild(buf[0], topic, topicLen, MQTTParseMessageQos(buf) ? topic + topicLen : NULL, \
+                                   payload, len);
+    return 0;
+}
+
+/**
+ * @brief   把 MQTT 5.0 的 PUBLISH 报文原地转换成 3.1.1 格式 (去掉属性, 还原 topic 别名),
+ *          这样 mqttGetTopic/mqttGetMsg 和 recvCB 不需要区分协议版本, 负载也不需要移动
+ * @param   broker [in] broker 指针, broker->recvBuf 之前预留了 recvHeadroom(broker) 字节
+ * @return  0 成功, -1 报文格式错误或别名无效
+ * @warning 成功后 broker->recvBuf 指向转换后的报文
+ */
+static int publish5(MqttBroker *broker)
+{
+    MqttV5 *v5 = broker->v5;
+    uint8_t *buf = broker->recvBuf;
+    uint8_t flags = buf[0];
+    uint8_t rlb = sizeofLenth(buf);
+    uint32_t end = 1 + rlb + remainLenth(buf);
+    uint32_t topicLen, idLen, idPos, pos, propLen, propEnd, value, alias = 0, n;
+    const uint8_t *topic;
+    char *store;
+    uint8_t id;
+
+    if(end - (1 + rlb) < 2)
+        return -1;
+    topicLen = buf[1 + rlb] << 8 | buf[1 + rlb + 1];
+    idLen = MQTTParseMessageQos(buf) ? 2 : 0;
+    idPos = 1 + rlb + 2 + topicLen;
+    pos = idPos + idLen;
+    if(pos >= end || !(n = varintDecode(buf + pos, end - pos, &propLen)))
+        return -1;
+    propEnd = pos + n + propLen;
+    if(propEnd > end)
+        return -1;
+    for(pos += n; pos < propEnd; pos += n)
+    {
+        if(!(n = propNext(buf + pos, propEnd - pos, &id, &value)))
+            return -1;
+        if(MQTT_PROP_ALIAS == id)
+            alias = value;
+    }
+    if(alias && (alias > v5->aliasMax || alias > MQTT_ALIAS_MAX))
+        return -1;
+    if(topicLen)
+    {
+        topic = buf + 1 + rlb + 2;
+        if(alias)
+        {
+            // 建立或更新别名, 内存不足时不保存 (本条消息照常处理, 之后只带别名的消息才会出错)
+            v5->recvAliasLen[alias - 1] = 0;
+            if(topicLen > v5->recvAliasSize[alias - 1])
+            {
+                store = realloc(v5->recvAlias[alias - 1], topicLen);
+                if(store)
+                {
+                    v5->recvAlias[alias - 1] = store;
+                    v5->recvAliasSize[alias - 1] = topicLen;
+                }
+            }
+            if(topicLen <= v5->recvAliasSize[alias - 1])
+            {
+                memcpy(v5->recvAlias[alias - 1], topic, topicLen);
+                v5->recvAliasLen[alias - 1] = topicLen;
+                // 之后收包时预留足够的空间还原这个别名
+                if(topicLen > v5->recvAliasTopic)
+                    v5->recvAliasTopic = topicLen;
+            }
+        }
+    }
+    else
+    {
+        // topic 为空, 必须使用已建立的别名
+        if(!alias || !v5->recvAliasLen[alias - 1])
+            return -1;
+        topicLen = v5->recvAliasLen[alias - 1];
+        topic = (const uint8_t*)v5->recvAlias[alias - 1];
+    }
+
+    broker->recvBuf = publishBuild(flags, topic, topicLen, idLen ? buf + idPos : NULL, buf + propEnd, end - propEnd);
+    return 0;
+}
+
+/**
+ * @brief   查找或分配发送 topic 别名
+ * @param   v5 [in] MQTT 5.0 状态
+ * @param   topic [in] topic
+ * @param   len [in] topic 长度
+ * @param   isNew [out] 1 = 新分配的别名, 本次发送仍需带上完整 topic
+ * @return  别名, 0 = 不使用别名
+ */
+static uint16_t aliasGet(MqttV5 *v5, const char *topic, uint16_t len, uint8_t *isNew)
+{
+    uint16_t i;
+
+    *isNew = 0;
+    for(i = 0; i < v5->sendAliasCount; i++)
+    {
+        if(v5->sendAliasLen[i] == len && !memcmp(v5->sendAlias[i], topic, len))
+            return i + 1;
+    }
+    if(i < v5->serverAliasMax && i < MQTT_ALIAS_MAX && len <= MQTT_ALIAS_TOPIC)
+    {
+        memcpy(v5->sendAlias[i], topic, len);
+        v5->sendAliasLen[i] = len;
+        v5->sendAliasCount++;
+        *isNew = 1;
+        return i + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   占用一个 QoS 1/2 发送名额, 未完成的消息数不能超过服务器的 Receive Maximum
+ * @param   v5 [in] MQTT 5.0 状态
+ * @return  0 成功, -1 名额已满
+ * @note    发布线程和接收线程都会修改 inflight, 使用原子操作
+ */
+static int inflightTake(MqttV5 *v5)
+{
+    uint16_t n = __atomic_load_n(&v5->inflight, __ATOMIC_RELAXED);
+
+    do {
+        // serverRecvMax 为 0 说明还没有收到 CONNACK, 不限制
+        if(v5->serverRecvMax && n >= v5->serverRecvMax)
+            return -1;
+    } while(!__atomic_compare_exchange_n(&v5->inflight, &n, n + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+/**
+ * @brief   归还一个 QoS 1/2 发送名额, 不会减到 0 以下 (重传导致的重复应答)
+ * @param   v5 [in] MQTT 5.0 状态
+ */
+static void inflightDone(MqttV5 *v5)
+{
+    uint16_t n = __atomic_load_n(&v5->inflight, __ATOMIC_RELAXED);
+
+    while(n && !__atomic_compare_exchange_n(&v5->inflight, &n, n - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 uint16_t mqttMsgID(const uint8_t *buf)
 {
     uint16_t id = 0;
@@ -171,7 +677,7 @@ int32_t mqttGetMsg(const uint8_t *buf, const uint8_t **ppMsg)
 {
     int32_t msglen;
     uint8_t rlb;
-    uint8_t offset;
+    uint32_t offset;
 
     if(MQTTParseMessageType(buf) == MQTT_MSG_PUBLISH)
     {
@@ -205,11 +711,31 @@ MqttRet mqttConnect(MqttBroker *broker)
     uint16_t passwordlen = strlen(broker->password);
     uint16_t packetlen;
     uint16_t remainLen;
+    uint8_t propLen = 0;
     int32_t offset;
     MqttRet ret;
 
     // 可变头
     remainLen = 10;
+    if(broker->v5)
+    {
+        // 别名表只在一次连接内有效
+        if(broker->v5->aliasMax > MQTT_ALIAS_MAX)
+            broker->v5->aliasMax = MQTT_ALIAS_MAX;
+        broker->v5->sendAliasCount = 0;
+        broker->v5->serverAliasMax = 0;
+        memset(broker->v5->recvAliasLen, 0, sizeof(broker->v5->recvAliasLen));
+        broker->v5->recvAliasTopic = 0;
+        __atomic_store_n(&broker->v5->inflight, 0, __ATOMIC_RELAXED);
+        // 属性, 总长度小于 128, 属性长度字段只占 1 字节
+        if(broker->v5->recvMax)
+            propLen += 3;
+        if(broker->v5->maxPacket)
+            propLen += 5;
+        if(broker->v5->aliasMax)
+            propLen += 3;
+        remainLen += 1 + propLen;
+    }
     // 负载 ID
     if(clientidlen)
         remainLen += 2 + clientidlen;
@@ -226,7 +752,7 @@ MqttRet mqttConnect(MqttBroker *broker)
         return MQTT_MEM_ERR;
     offset = sizeofLenth(packet) + 1;
     packetWrite(packet, &offset, "MQTT", 4);
-    packet[offset++] = 0x04; // 协议版本 3.1.1
+    packet[offset++] = broker->v5 ? 0x05 : 0x04; // 协议版本 5.0 或 3.1.1
     // 连接标志字节
     packet[offset] = 0;
     if(usernamelen)
@@ -238,6 +764,30 @@ MqttRet mqttConnect(MqttBroker *broker)
     offset++;
     packet[offset++] = broker->alive >> 8;   // Keep alive MSB
     packet[offset++] = broker->alive & 0xFF; // Keep alive LSB
+    if(broker->v5)
+    {
+        packet[offset++] = propLen;
+        if(broker->v5->recvMax)
+        {
+            packet[offset++] = MQTT_PROP_RECV_MAX;
+            packet[offset++] = broker->v5->recvMax >> 8;
+            packet[offset++] = broker->v5->recvMax & 0xFF;
+        }
+        if(broker->v5->maxPacket)
+        {
+            packet[offset++] = MQTT_PROP_MAX_PACKET;
+            packet[offset++] = broker->v5->maxPacket >> 24;
+            packet[offset++] = (broker->v5->maxPacket >> 16) & 0xFF;
+            packet[offset++] = (broker->v5->maxPacket >> 8) & 0xFF;
+            packet[offset++] = broker->v5->maxPacket & 0xFF;
+        }
+        if(broker->v5->aliasMax)
+        {
+            packet[offset++] = MQTT_PROP_ALIAS_MAX;
+            packet[offset++] = broker->v5->aliasMax >> 8;
+            packet[offset++] = broker->v5->aliasMax & 0xFF;
+        }
+    }
     // Client ID - UTF 编码
     packetWrite(packet, &offset, broker->clientid, clientidlen);
     if(usernamelen)
@@ -246,15 +796,15 @@ MqttRet mqttConnect(MqttBroker *broker)
         packetWrite(packet, &offset, broker->password, passwordlen);
     ret = MQTT_OK;
     // 等待回复 (offset 用于计数)
-    broker->waitType = MQTT_MSG_CONNACK;
+    waitSet(broker, MQTT_MSG_CONNACK, 0);
     for(offset = 0; offset < MQTT_RETRY; offset++)
     {
-        if(mqttSend(broker->socket, packet, packetlen) < packetlen)
+        if(brokerSend(broker, packet, packetlen) < packetlen)
         {
             ret = MQTT_SEND_ERR; // 一旦发送出错, 立刻终止重传
             break;
         }
-        if(mqttWaitAck(broker, MQTT_TIMEOUE))
+        if(waitAck(broker))
             break; // 收到期望的回复则返回, 超时未收到期望的回复则重传
     }
     free(packet);
@@ -262,6 +812,8 @@ MqttRet mqttConnect(MqttBroker *broker)
     {
         if(MQTT_RETRY == offset)
             return MQTT_ACK_ERR; // 服务器不理我
+        else if(broker->v5)
+            return connackRet5(broker->waitParam); // 5.0 的原因码
         else
             return broker->waitParam; // 应该是 <= 5 的数值, 描述连接返回码
     }
@@ -276,7 +828,7 @@ MqttRet mqttDisconnect(MqttBroker *broker)
         0x00 // 剩余长度
     };
 
-    if(mqttSend(broker->socket, packet, sizeof(packet)) < (int32_t)sizeof(packet))
+    if(brokerSend(broker, packet, sizeof(packet)) < (int32_t)sizeof(packet))
         return MQTT_SEND_ERR;
     return MQTT_OK;
 }
@@ -288,62 +840,121 @@ MqttRet mqttPing(MqttBroker *broker)
         0x00 // 剩余长度
     };
 
-    if(mqttSend(broker->socket, packet, sizeof(packet)) < (int)sizeof(packet))
+    if(brokerSend(broker, packet, sizeof(packet)) < (int)sizeof(packet))
         return MQTT_SEND_ERR;
     return MQTT_OK;
 }
 
-MqttRet mqttPublish(MqttBroker *broker, const char *topic, const char *msg, uint8_t retain, uint8_t qos)
+/**
+ * @brief   发布消息
+ * @param   msgID [out] NULL 时阻塞等待应答并重传; 否则只发送一次, 输出消息 ID, 应答通过 broker->ackCB 通知
+ * @return  参考 MqttRet
+ */
+static MqttRet publish(MqttBroker *broker, const char *topic, const void *data, uint32_t len, \
+                       uint8_t retain, uint8_t qos, uint16_t *msgID)
 {
     uint8_t *packet;
-    uint16_t packetlen;
-    uint16_t topiclen = strlen(topic);
-    uint16_t msglen = strlen(msg);
+    int32_t packetlen;
+    int32_t topiclen = topicLenth(topic, 0);
+    const uint8_t *msg = data;
+    int32_t msglen = len;
+    uint8_t head[MQTT_CODEC_HEAD];
+    uint32_t headlen = 0;
+    int32_t sendlen;
     int32_t offset;
+    uint16_t alias = 0;
+    uint8_t aliasNew = 0;
     MqttRet ret;
 
+    if(topiclen < 0)
+        return MQTT_PARAM_ERR;
+    // 5.0 服务器同时接收的 QoS 1/2 消息数有上限, 超过是协议错误, 服务器会断开连接
+    if(broker->v5 && qos && inflightTake(broker->v5))
+        return MQTT_SIZE_ERR;
+    MQTT_TRACE(broker, MQTT_STAGE_ENCODE | MQTT_TRACE_BEGIN, MQTT_MSG_PUBLISH, qos ? broker->seq : 0, len);
+    // 负载编码, msg 指向编码结果, 编解码头和报文头放在一起发送
+    if(broker->codec)
+        msglen = mqttCodecEncode(broker->codec, data, len, head, &headlen, &msg);
+    sendlen = topiclen;
+    if(broker->v5)
+    {
+        // 已建立别名的 topic 只发送 2 字节别名, topic 为空
+        alias = aliasGet(broker->v5, topic, topiclen, &aliasNew);
+        if(alias && !aliasNew)
+            sendlen = 0;
+    }
     packetlen = packetCreate(&packet, MQTT_MSG_PUBLISH | ((qos & 0x03) << 1) | (!!retain), \
-                             topiclen + 2 + (qos ? 2 : 0) + msglen, msglen);
+                             sendlen + 2 + (qos ? 2 : 0) + (broker->v5 ? (alias ? 4 : 1) : 0) + headlen + msglen, msglen);
     if(!packet)
-        return MQTT_MEM_ERR;
+        ret = MQTT_MEM_ERR;
+    else if(broker->v5 && broker->v5->serverMaxPacket && (uint32_t)packetlen + msglen > broker->v5->serverMaxPacket)
+    {
+        free(packet);
+        ret = MQTT_SIZE_ERR;
+    }
+    else
+        ret = MQTT_OK;
+    if(MQTT_OK != ret)
+    {
+        MQTT_TRACE(broker, MQTT_STAGE_ENCODE | MQTT_TRACE_END, MQTT_MSG_PUBLISH, qos ? broker->seq : 0, 0);
+        if(aliasNew)
+            broker->v5->sendAliasCount--; // 别名没有发出去, 撤销
+        if(broker->v5 && qos)
+            inflightDone(broker->v5);
+        return ret;
+    }
     offset = sizeofLenth(packet) + 1;
-    packetWrite(packet, &offset, topic, topiclen);
+    packetWrite(packet, &offset, topic, sendlen);
     if(qos)
     {
         packet[offset++] = broker->seq >> 8;
         packet[offset++] = broker->seq & 0xFF;
     }
-    ret = MQTT_OK;
+    if(broker->v5)
+    {
+        // 属性
+        packet[offset++] = alias ? 3 : 0;
+        if(alias)
+        {
+            packet[offset++] = MQTT_PROP_ALIAS;
+            packet[offset++] = alias >> 8;
+            packet[offset++] = alias & 0xFF;
+        }
+    }
+    memcpy(packet + offset, head, headlen);
+    MQTT_TRACE(broker, MQTT_STAGE_ENCODE | MQTT_TRACE_END, MQTT_MSG_PUBLISH, qos ? broker->seq : 0, packetlen + msglen);
+    if(msgID)
+        *msgID = qos ? broker->seq : 0;
     // 等待回复 (offset 用于计数)
-    if(1 == qos)
-        broker->waitType = MQTT_MSG_PUBACK;
-    if(2 == qos)
-        broker->waitType = MQTT_MSG_PUBREC;
-    broker->waitParam = broker->seq;
+    if(!msgID && qos)
+        waitSet(broker, (1 == qos) ? MQTT_MSG_PUBACK : MQTT_MSG_PUBREC, broker->seq);
     for(offset = 0; offset < MQTT_RETRY; offset++)
     {
         // 分两段发送报文, 减少内存占用
-        if(mqttSend(broker->socket, packet, packetlen) < packetlen)
-        {
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_BEGIN, MQTT_MSG_PUBLISH, qos ? broker->seq : 0, packetlen + msglen);
+        // 两段之间不能插入其它线程的报文, 发送锁可重入
+        if(broker->sendLock)
+            mqttLock(broker->sendLock);
+        if(brokerSend(broker, packet, packetlen) < packetlen || brokerSend(broker, msg, msglen) < msglen)
             ret = MQTT_SEND_ERR;
+        if(broker->sendLock)
+            mqttUnlock(broker->sendLock);
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_END, MQTT_MSG_PUBLISH, qos ? broker->seq : 0, packetlen + msglen);
+        if(MQTT_SEND_ERR == ret)
             break;
-        }
-        if(mqttSend(broker->socket, msg, msglen) < msglen)
+        if(qos && !msgID)
         {
-            ret = MQTT_SEND_ERR;
-            break;
-        }
-        if(qos)
-        {
-            if(mqttWaitAck(broker, MQTT_TIMEOUE))
+            if(waitAck(broker))
             {
+                if(broker->v5 && broker->v5->reason >= 0x80)
+                {
+                    ret = MQTT_REASON_ERR; // 服务器拒绝, QoS 2 流程到此结束
+                    break;
+                }
                 if(2 == qos)
                 {
-                    broker->seq++;
-                    if(!broker->seq)
-                        broker->seq++;
-                    broker->waitType = MQTT_MSG_PUBCOMP;
-                    broker->waitParam = broker->seq;
+                    // PUBREL 和 PUBCOMP 使用与 PUBLISH 相同的消息 ID
+                    waitSet(broker, MQTT_MSG_PUBCOMP, broker->seq);
                     for(offset = 0; offset < MQTT_RETRY; offset++)
                     {
                         if(mqttPubRetuen(broker, MQTT_MSG_PUBREL | MQTT_QOS1_FLAG, broker->seq))
@@ -351,17 +962,24 @@ MqttRet mqttPublish(MqttBroker *broker, const char *topic, const char *msg, uint
                             ret = MQTT_SEND_ERR;
                             break;
                         }
-                        if(mqttWaitAck(broker, MQTT_TIMEOUE))
+                        if(waitAck(broker))
                             break; // 收到期望的回复则返回, 超时未收到期望的回复则重传
                     }
+                    if(MQTT_OK == ret && offset < MQTT_RETRY && broker->v5 && broker->v5->reason >= 0x80)
+                        ret = MQTT_REASON_ERR; // PUBCOMP 的失败原因码, 如 Packet Identifier not found
                 }
                 break; // 收到期望的回复则返回, 超时未收到期望的回复则重传
             }
         }
         else
-            break; // QOS = 0 时只发送一次
+            break; // QOS = 0 或不等待应答时只发送一次
     }
     free(packet);
+    if(MQTT_SEND_ERR == ret && aliasNew)
+        broker->v5->sendAliasCount--; // 别名没有发出去, 撤销
+    // 发送失败或超时没有收到 PUBACK/PUBCOMP 时 mqttThread 不会归还名额, 在这里归还
+    if(broker->v5 && qos && (MQTT_SEND_ERR == ret || (MQTT_OK == ret && MQTT_RETRY == offset)))
+        inflightDone(broker->v5);
     if(qos)
     {
         broker->seq++;
@@ -374,6 +992,35 @@ MqttRet mqttPublish(MqttBroker *broker, const char *topic, const char *msg, uint
         return ret;
 }
 
+MqttRet mqttPublishData(MqttBroker *broker, const char *topic, const void *data, uint32_t len, uint8_t retain, uint8_t qos)
+{
+    return publish(broker, topic, data, len, retain, qos, NULL);
+}
+
+MqttRet mqttPublishAsync(MqttBroker *broker, const char *topic, const void *data, uint32_t len, \
+                         uint8_t retain, uint8_t qos, uint16_t *msgID)
+{
+    return publish(broker, topic, data, len, retain, qos, msgID);
+}
+
+MqttRet mqttPublish(MqttBroker *broker, const char *topic, const char *msg, uint8_t retain, uint8_t qos)
+{
+    return mqttPublishData(broker, topic, msg, strlen(msg), retain, qos);
+}
+
+void mqttV5Free(MqttV5 *v5)
+{
+    int i;
+
+    for(i = 0; i < MQTT_ALIAS_MAX; i++)
+    {
+        free(v5->recvAlias[i]);
+        v5->recvAlias[i] = NULL;
+        v5->recvAliasLen[i] = v5->recvAliasSize[i] = 0;
+    }
+    v5->recvAliasTopic = 0;
+}
+
 MqttRet mqttPubRetuen(MqttBroker *broker, uint8_t type, uint16_t msgID)
 {
     uint8_t packet[] = {
@@ -382,42 +1029,89 @@ MqttRet mqttPubRetuen(MqttBroker *broker, uint8_t type, uint16_t msgID)
         msgID >> 8,
         msgID & 0xFF
     };
+    int32_t ret;
 
-    if(mqttSend(broker->socket, packet, sizeof(packet)) < (int32_t)sizeof(packet))
+    MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_BEGIN, type & 0xF0, msgID, sizeof(packet));
+    ret = brokerSend(broker, packet, sizeof(packet));
+    MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_END, type & 0xF0, msgID, sizeof(packet));
+    if(ret < (int32_t)sizeof(packet))
         return MQTT_SEND_ERR;
     return MQTT_OK;
 }
 
-MqttRet mqttSubscribe(MqttBroker *broker, const char *topic, uint8_t qos)
+/**
+ * @brief   批量发送 mqttPubRetuen 格式的应答报文 (每个 4 字节), 供 libmqttengine.c 发送排队的应答
+ * @param   broker [in] broker 指针, 调用者持有 sendLock
+ * @param   data [in] 报文
+ * @param   len [in] 长度, 4 的倍数
+ * @return  已发送的字节数 (4 的倍数, 发送缓冲区满时为 0), < 0 发送错误
+ * @note    直接收发 socket 时不等待可写, 只在一个报文发送了一部分时等它发完;
+ *          传输层 (WebSocket/TLS) 不能只发送一部分, 整批发送, 可能等待可写
+ */
+int32_t mqttSendAcks(MqttBroker *broker, const uint8_t *data, unsigned int len)
+{
+    int32_t ret, rest;
+
+    if(broker->transport)
+        ret = broker->transport->send(broker->conn, data, len);
+    else
+    {
+        ret = mqttSendNow(broker->socket, data, len);
+        if(ret > 0 && ret % 4)
+        {
+            rest = 4 - ret % 4;
+            ret = (mqttSend(broker->socket, data + ret, rest) == rest) ? ret + rest : -1;
+        }
+    }
+    if(broker->capture && ret > 0)
+        mqttCapture(broker->capture, broker, MQTT_CAP_OUT, data, ret);
+    return ret;
+}
+
+/**
+ * @brief   订阅某个 topic
+ * @param   msgID [out] NULL 时阻塞等待应答并重传; 否则只发送一次, 输出消息 ID, 应答通过 broker->ackCB 通知
+ * @return  参考 MqttRet
+ */
+static MqttRet subscribe(MqttBroker *broker, const char *topic, uint8_t qos, uint16_t *msgID)
 {
     uint8_t *packet;
-    uint16_t topiclen;
+    int32_t topiclen;
     int32_t packetlen;
     int32_t offset;
     MqttRet ret;
 
-    topiclen = strlen(topic);
-    packetlen = packetCreate(&packet, MQTT_MSG_SUBSCRIBE | MQTT_QOS1_FLAG, topiclen + 5, 0);
+    topiclen = topicLenth(topic, 1);
+    if(topiclen < 0)
+        return MQTT_PARAM_ERR;
+    packetlen = packetCreate(&packet, MQTT_MSG_SUBSCRIBE | MQTT_QOS1_FLAG, topiclen + 5 + (broker->v5 ? 1 : 0), 0);
     if(!packet)
         return MQTT_MEM_ERR;
     offset = sizeofLenth(packet) + 1;
     // 可变头
     packet[offset++] = broker->seq >> 8; // Message ID
     packet[offset++] = broker->seq & 0xFF;
+    if(broker->v5)
+        packet[offset++] = 0; // 属性长度
     packetWrite(packet, &offset, topic, topiclen);
     packet[offset] = qos;
     ret = MQTT_OK;
     // 等待回复 (offset 用于计数)
-    broker->waitType = MQTT_MSG_SUBACK;
-    broker->waitParam = broker->seq;
+    if(msgID)
+        *msgID = broker->seq;
+    else
+        waitSet(broker, MQTT_MSG_SUBACK, broker->seq);
     for(offset = 0; offset < MQTT_RETRY; offset++)
     {
-        if(mqttSend(broker->socket, packet, packetlen) < packetlen)
-        {
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_BEGIN, MQTT_MSG_SUBSCRIBE, broker->seq, packetlen);
+        if(brokerSend(broker, packet, packetlen) < packetlen)
             ret = MQTT_SEND_ERR;
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_END, MQTT_MSG_SUBSCRIBE, broker->seq, packetlen);
+        if(MQTT_SEND_ERR == ret)
             break;
-        }
-        if(mqttWaitAck(broker, MQTT_TIMEOUE))
+        if(msgID)
+            break; // 不等待应答时只发送一次
+        if(waitAck(broker))
             break; // 收到期望的回复则返回, 超时未收到期望的回复则重传
     }
     free(packet);
@@ -426,39 +1120,55 @@ MqttRet mqttSubscribe(MqttBroker *broker, const char *topic, uint8_t qos)
         broker->seq++;
     if(MQTT_OK == ret && MQTT_RETRY == offset)
         return MQTT_ACK_ERR; // 服务器不理我
+    else if(MQTT_OK == ret && !msgID && broker->v5 && broker->v5->reason >= 0x80)
+        return MQTT_REASON_ERR;
     else
         return ret;
 }
 
-MqttRet mqttUnsubscribe(MqttBroker *broker, const char *topic)
+/**
+ * @brief   取消订阅某个 topic
+ * @param   msgID [out] NULL 时阻塞等待应答并重传; 否则只发送一次, 输出消息 ID, 应答通过 broker->ackCB 通知
+ * @return  参考 MqttRet
+ */
+static MqttRet unsubscribe(MqttBroker *broker, const char *topic, uint16_t *msgID)
 {
     uint8_t *packet;
-    uint16_t topiclen;
+    int32_t topiclen;
     int32_t packetlen;
     int32_t offset;
     MqttRet ret;
 
-    topiclen = strlen(topic);
-    packetlen = packetCreate(&packet, MQTT_MSG_UNSUBSCRIBE | MQTT_QOS1_FLAG, topiclen + 4, 0);
+    topiclen = topicLenth(topic, 1);
+    if(topiclen < 0)
+        return MQTT_PARAM_ERR;
+    packetlen = packetCreate(&packet, MQTT_MSG_UNSUBSCRIBE | MQTT_QOS1_FLAG, topiclen + 4 + (broker->v5 ? 1 : 0), 0);
     if(!packet)
         return MQTT_MEM_ERR;
     offset = sizeofLenth(packet) + 1;
     // 可变头
     packet[offset++] = broker->seq >> 8; // Message ID
     packet[offset++] = broker->seq & 0xFF;
+    if(broker->v5)
+        packet[offset++] = 0; // 属性长度
     packetWrite(packet, &offset, topic, topiclen);
     ret = MQTT_OK;
     // 等待回复 (offset 用于计数)
-    broker->waitType = MQTT_MSG_UNSUBACK;
-    broker->waitParam = broker->seq;
+    if(msgID)
+        *msgID = broker->seq;
+    else
+        waitSet(broker, MQTT_MSG_UNSUBACK, broker->seq);
     for(offset = 0; offset < MQTT_RETRY; offset++)
     {
-        if(mqttSend(broker->socket, packet, packetlen) < packetlen)
-        {
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_BEGIN, MQTT_MSG_UNSUBSCRIBE, broker->seq, packetlen);
+        if(brokerSend(broker, packet, packetlen) < packetlen)
             ret = MQTT_SEND_ERR;
+        MQTT_TRACE(broker, MQTT_STAGE_SEND | MQTT_TRACE_END, MQTT_MSG_UNSUBSCRIBE, broker->seq, packetlen);
+        if(MQTT_SEND_ERR == ret)
             break;
-        }
-        if(mqttWaitAck(broker, MQTT_TIMEOUE))
+        if(msgID)
+            break; // 不等待应答时只发送一次
+        if(waitAck(broker))
             break; // 收到期望的回复则返回, 超时未收到期望的回复则重传
     }
     free(packet);
@@ -467,96 +1177,359 @@ MqttRet mqttUnsubscribe(MqttBroker *broker, const char *topic)
         broker->seq++;
     if(MQTT_OK == ret && MQTT_RETRY == offset)
         return MQTT_ACK_ERR; // 服务器不理我
+    else if(MQTT_OK == ret && !msgID && broker->v5 && broker->v5->reason >= 0x80)
+        return MQTT_REASON_ERR;
     else
         return ret;
 }
 
+MqttRet mqttSubscribe(MqttBroker *broker, const char *topic, uint8_t qos)
+{
+    return subscribe(broker, topic, qos, NULL);
+}
+
+MqttRet mqttSubscribeAsync(MqttBroker *broker, const char *topic, uint8_t qos, uint16_t *msgID)
+{
+    return subscribe(broker, topic, qos, msgID);
+}
+
+MqttRet mqttUnsubscribe(MqttBroker *broker, const char *topic)
+{
+    return unsubscribe(broker, topic, NULL);
+}
+
+MqttRet mqttUnsubscribeAsync(MqttBroker *broker, const char *topic, uint16_t *msgID)
+{
+    return unsubscribe(broker, topic, msgID);
+}
+
 /**
- * @brief   阻塞式接收报文, 将收到的数据包放到 broker->recvBuf 里
+ * @brief   解析应答报文中的原因码
  * @param   broker [in] broker 指针
- * @return  >0 成功并返回报文长度, 0 连接已关闭, -1 IO 错误, -2 内存不足
- * @warning 使用完毕后需要释放 broker->recvBuf
+ * @param   buf [in] 指向数据包的指针
+ * @return  5.0 的原因码; 3.1.1 只有 SUBACK 带返回码 (授予的 QoS 或 0x80 失败), 其它为 0
+ */
+static uint8_t ackReason(const MqttBroker *broker, const uint8_t *buf)
+{
+    if(broker->v5)
+        return reason5(buf);
+    if(MQTTParseMessageType(buf) == MQTT_MSG_SUBACK && remainLenth(buf) >= 3)
+        return buf[1 + sizeofLenth(buf) + 2];
+    return 0;
+}
+
+/**
+ * @brief   mqttThread 回复应答, 设置了 broker->ackSend 时交给它发送
+ */
+static MqttRet ackSend(MqttBroker *broker, uint8_t type, uint16_t msgID)
+{
+    if(broker->ackSend)
+        return (MqttRet)broker->ackSend(broker, type, msgID);
+    return mqttPubRetuen(broker, type, msgID);
+}
+
+/**
+ * @brief   计入一条交给应用的消息, 在调用 recvCB 之前, recvCB 中可以直接 mqttFlowRelease
+ * @param   flow [in] 流量控制状态
+ * @param   len [in] 负载长度
+ */
+static void flowCharge(MqttFlow *flow, uint32_t len)
+{
+    mqttFlowLock(flow);
+    flow->msgs++;
+    flow->bytes += len;
+    mqttFlowUnlock(flow);
+}
+
+/**
+ * @brief   recvCB 返回后检查高水位, 超过时停止读取并推迟这条消息的应答
+ * @param   flow [in] 流量控制状态
+ * @param   ackType [in] 这条消息的应答类型, 0 = QoS 0 无应答
+ * @param   msgID [in] 这条消息的 ID
+ * @return  1 已推迟应答 (或停止读取), 0 照常应答
  */
-static int32_t mqttGetPacket(MqttBroker *broker)
+static int flowCheck(MqttFlow *flow, uint8_t ackType, uint16_t msgID)
 {
-    static uint8_t fixedHeader[5]; // 最大 5 字节
-    int32_t lenth, total, packetlen;
+    int paused = 0;
 
-    // 先收 2 字节固定头
-    for(total = 0; total < 2; total += lenth)
+    mqttFlowLock(flow);
+    if((flow->maxMsgs && flow->msgs >= flow->maxMsgs) || (flow->maxBytes && flow->bytes >= flow->maxBytes))
     {
-        if((lenth = mqttRecv(broker->socket, fixedHeader + total, 2 - total)) <= 0)
-            return lenth;
+        __atomic_store_n(&flow->paused, 1, __ATOMIC_RELEASE); // 引擎 I/O 线程不进锁读取
+        flow->ackType = ackType;
+        flow->ackID = msgID;
+        paused = 1;
     }
-    // 接收完整的固定头
-    for(; fixedHeader[total - 1] & 0x80; total += lenth)
+    mqttFlowUnlock(flow);
+    return paused;
+}
+
+MqttRet mqttFlowRelease(MqttBroker *broker, uint32_t len)
+{
+    MqttFlow *flow = broker->flow;
+    uint8_t ackType = 0;
+    uint16_t ackID = 0;
+
+    if(!flow)
+        return MQTT_PARAM_ERR;
+    mqttFlowLock(flow);
+    if(flow->msgs)
+        flow->msgs--;
+    flow->bytes = (flow->bytes > len) ? flow->bytes - len : 0;
+    if(flow->paused && (!flow->maxMsgs || flow->msgs <= flow->lowMsgs) \
+       && (!flow->maxBytes || flow->bytes <= flow->lowBytes))
     {
-        if(total >= (int32_t)sizeof(fixedHeader))
-            return -1;
-        if((lenth = mqttRecv(broker->socket, (char*)fixedHeader + total, 1)) <= 0)
-            return lenth;
+        ackType = flow->ackType;
+        ackID = flow->ackID;
+        flow->ackType = 0;
+        __atomic_store_n(&flow->paused, 0, __ATOMIC_RELEASE);
+        mqttFlowWake(flow);
     }
+    mqttFlowUnlock(flow);
+    // 在这里发送推迟的应答, 不依赖接收线程: 服务器可能正在等这个应答, 不会再发来数据
+    if(ackType)
+        return mqttPubRetuen(broker, ackType, ackID);
+    return MQTT_OK;
+}
+
+/**
+ * @brief   接收缓冲区前部预留的空间
+ * @param   broker [in] broker 指针
+ * @return  预留的字节数
+ */
+static uint32_t recvHeadroom(const MqttBroker *broker)
+{
+    // 用于原地还原 topic 别名, 剩余长度字段最多变长 1 字节
+    return broker->v5 ? broker->v5->recvAliasTopic + 1 : 0;
+}
+
+/**
+ * @brief   跟踪记录用的消息 ID, 没有 ID 的报文 (如 Qos 0 的 PUBLISH) 返回 0
+ */
+static uint16_t traceID(const uint8_t *buf)
+{
+    uint8_t type = MQTTParseMessageType(buf);
+
+    if(MQTT_MSG_PUBLISH == type)
+        return MQTTParseMessageQos(buf) ? mqttMsgID(buf) : 0;
+    if(type >= MQTT_MSG_PUBACK && type <= MQTT_MSG_UNSUBACK)
+        return mqttMsgID(buf);
+    return 0;
+}
 
-    packetlen = 1 + sizeofLenth(fixedHeader) + remainLenth(fixedHeader);
-    broker->recvBuf = (uint8_t*)malloc(packetlen);
-    if(!broker->recvBuf)
-        return -2;
-    memcpy(broker->recvBuf, fixedHeader, total);
-    for(; total < packetlen; total += lenth)
+/**
+ * @brief   接收报文, 将收到的数据包放到 broker->recvBuf 里
+ * @param   broker [in] broker 指针
+ * @param   packet [out] 分配的内存 (recvBuf 之前有预留空间)
+ * @return  >0 成功并返回报文长度, 0 连接已关闭, -1 IO 错误, -2 内存不足,
+ *          -3 报文超过 MqttV5.maxPacket, MQTT_RECV_AGAIN 报文没有收完 (只在非阻塞模式下)
+ * @note    收到一半的报文保存在 broker->rx* 中, 下次调用时继续; 出错时释放
+ * @warning 成功时使用完毕后需要释放 *packet
+ */
+static int32_t mqttGetPacket(MqttBroker *broker, uint8_t **packet)
+{
+    uint32_t room;
+    int32_t lenth;
+
+    if(!broker->rxPacket)
     {
-        if((lenth = mqttRecv(broker->socket, (char*)(broker->recvBuf) + total, packetlen - total)) <= 0)
+        // 先收 2 字节固定头, 再按剩余长度字段的延续位逐字节接收
+        while(broker->rxHeadLen < 2 || (broker->rxHead[broker->rxHeadLen - 1] & 0x80))
         {
-            free(broker->recvBuf);
+            if(broker->rxHeadLen >= sizeof(broker->rxHead))
+            {
+                broker->rxHeadLen = 0;
+                return -1;
+            }
+            lenth = brokerRecv(broker, broker->rxHead + broker->rxHeadLen, (broker->rxHeadLen < 2) ? 2 - broker->rxHeadLen : 1);
+            if(lenth <= 0)
+            {
+                if(MQTT_RECV_AGAIN != lenth)
+                    broker->rxHeadLen = 0;
+                return lenth;
+            }
+            broker->rxHeadLen += lenth;
+        }
+        broker->rxTotal = 1 + sizeofLenth(broker->rxHead) + remainLenth(broker->rxHead);
+        broker->rxLen = broker->rxHeadLen;
+        broker->rxHeadLen = 0;
+        // 在分配内存之前拒绝过大的报文
+        if(broker->v5 && broker->v5->maxPacket && broker->rxTotal > broker->v5->maxPacket)
+            return -3;
+        // 预留空间在分配时确定, 接收期间别名表可能被 mqttConnect 重置
+        room = recvHeadroom(broker);
+        broker->rxPacket = (uint8_t*)malloc(room + broker->rxTotal);
+        if(!broker->rxPacket)
+            return -2;
+        broker->recvBuf = broker->rxPacket + room;
+        memcpy(broker->recvBuf, broker->rxHead, broker->rxLen);
+    }
+    while(broker->rxLen < broker->rxTotal)
+    {
+        lenth = brokerRecv(broker, broker->recvBuf + broker->rxLen, broker->rxTotal - broker->rxLen);
+        if(lenth <= 0)
+        {
+            if(MQTT_RECV_AGAIN != lenth)
+            {
+                free(broker->rxPacket);
+                broker->rxPacket = NULL;
+            }
             return lenth;
         }
+        broker->rxLen += lenth;
     }
-    return total;
+    *packet = broker->rxPacket;
+    broker->rxPacket = NULL;
+    return broker->rxTotal;
 }
 
 int mqttThread(MqttBroker *broker)
 {
+    uint8_t *packet; // 分配的内存, recvBuf 可能在其中移动
+    const uint8_t *msg;
+    uint8_t ackType, delivered, paused = 0;
     int ret;
 
+    // 应用处理不过来时停止读取, 让 TCP 的流量控制反压到服务器; 非阻塞模式下不等待, 由调用者稍后再试
+    if(broker->flow)
+    {
+        mqttFlowLock(broker->flow);
+        while(broker->flow->paused && !broker->nonblock)
+            mqttFlowWait(broker->flow);
+        paused = broker->flow->paused;
+        mqttFlowUnlock(broker->flow);
+        if(paused)
+            return MQTT_RECV_AGAIN;
+    }
     // 接收一个完整数据包
-    ret = mqttGetPacket(broker);
+    ret = mqttGetPacket(broker, &packet);
     if(ret > 0)
     {
+        // 抓包记录原始报文, 必须在下面改写 recvBuf 之前
+        if(broker->capture)
+            mqttCapture(broker->capture, broker, MQTT_CAP_IN, broker->recvBuf, ret);
+        // 5.0 的 PUBLISH 先转换成 3.1.1 格式
+        if(broker->v5 && MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_PUBLISH && publish5(broker))
+        {
+            free(packet);
+            return -3;
+        }
+        // 格式错误或 topic 不合法的 PUBLISH 报文, 协议要求关闭连接
+        if(MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_PUBLISH && !publishCheck(broker->recvBuf))
+        {
+            free(packet);
+            return -3;
+        }
+        MQTT_TRACE(broker, MQTT_STAGE_RECV | MQTT_TRACE_INSTANT, MQTTParseMessageType(broker->recvBuf), \
+                   traceID(broker->recvBuf), ret);
+        // 5.0 服务器主动断开连接, 原因码见 MqttV5.reason
+        if(broker->v5 && MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_DISCONNECT)
+        {
+            broker->v5->reason = reason5(broker->recvBuf);
+            free(packet);
+            return 0;
+        }
+        // 5.0 QoS 1/2 发送完成: PUBACK, PUBCOMP 或失败的 PUBREC
+        if(broker->v5)
+        {
+            switch(MQTTParseMessageType(broker->recvBuf))
+            {
+            case MQTT_MSG_PUBACK: case MQTT_MSG_PUBCOMP:
+                inflightDone(broker->v5);
+                break;
+            case MQTT_MSG_PUBREC:
+                if(reason5(broker->recvBuf) >= 0x80)
+                    inflightDone(broker->v5);
+                break;
+            default:
+                break;
+            }
+        }
         // 如果收到了期望的消息就唤醒正在等待的线程
         // 期望的消息: 报文类型和 ID 都是想要的值; 但是 CONNACK 报文不返回 ID,
         // 而是服务器的响应, 所以 broker->waitType 设置成 MQTT_MSG_CONNACK 时 broker->waitParam 作为输出.
+        // 在锁内检查和唤醒, 等待的线程在锁内检查 waitType 后才进入等待, 唤醒不会丢失
+        if(broker->criticalSection)
+            mqttLock(broker->criticalSection);
         if((broker->waitType == MQTTParseMessageType(broker->recvBuf) && broker->waitParam == mqttMsgID(broker->recvBuf)) \
-           || (MQTT_MSG_CONNACK == broker->waitType))
+           || (MQTT_MSG_CONNACK == broker->waitType && MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_CONNACK))
         {
-            // broker->waitType 为 MQTT_MSG_CONNACK 时输出服务器返回的响应
+            // broker->waitType 为 MQTT_MSG_CONNACK 时输出服务器返回的响应 (5.0 为原因码),
+            // 剩余长度字段不一定只占 1 字节 (5.0 的 CONNACK 带属性)
             if(MQTT_MSG_CONNACK == broker->waitType)
-                broker->waitParam = broker->recvBuf[3];
+            {
+                if(broker->v5)
+                    broker->waitParam = reason5(broker->recvBuf);
+                else if(remainLenth(broker->recvBuf) >= 2)
+                    broker->waitParam = broker->recvBuf[1 + sizeofLenth(broker->recvBuf) + 1];
+                else
+                    broker->waitParam = MQTT_SERVER_ERR; // 格式错误
+            }
+            if(broker->v5)
+            {
+                if(MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_CONNACK)
+                    connack5(broker, broker->recvBuf);
+                broker->v5->reason = reason5(broker->recvBuf);
+            }
             broker->waitType = 0;
             mqttWakeUp(broker);
         }
+        if(broker->criticalSection)
+            mqttUnlock(broker->criticalSection);
+        // 通知应答, 用于不等待应答的发布和订阅
+        if(broker->ackCB)
+        {
+            switch(MQTTParseMessageType(broker->recvBuf))
+            {
+            case MQTT_MSG_PUBACK: case MQTT_MSG_PUBREC: case MQTT_MSG_PUBCOMP:
+            case MQTT_MSG_SUBACK: case MQTT_MSG_UNSUBACK:
+                broker->ackCB(broker, MQTTParseMessageType(broker->recvBuf), mqttMsgID(broker->recvBuf), \
+                              ackReason(broker, broker->recvBuf));
+                break;
+            default:
+                break;
+            }
+        }
         // 收到推送
         if(MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_PUBLISH)
         {
-            // 收到推送, 调用回调函数 (过滤 qos = 2 时的重复消息)
-            if(mqttMsgID(broker->recvBuf) != broker->seq2)
-                broker->recvCB(broker->recvBuf);
-            // Qos 1 需要回复 PUBACK
+            // Qos 1 需要回复 PUBACK, Qos 2 第一步回复 PUBREC
+            ackType = 0;
             if(MQTTParseMessageQos(broker->recvBuf) == 1)
-                mqttPubRetuen(broker, MQTT_MSG_PUBACK, mqttMsgID(broker->recvBuf));
-            // Qos 2 第一步回复 PUBREC
+                ackType = MQTT_MSG_PUBACK;
             if(MQTTParseMessageQos(broker->recvBuf) == 2)
+                ackType = MQTT_MSG_PUBREC;
+            delivered = 0;
+            // 收到推送, 更新缓存并调用回调函数 (过滤 qos = 2 时的重复消息; 负载无法解码的消息丢弃, 但仍然应答)
+            if((MQTTParseMessageQos(broker->recvBuf) != 2 || mqttMsgID(broker->recvBuf) != broker->seq2) \
+               && (!broker->codec || !publishDecode(broker)))
             {
-                broker->seq2 = mqttMsgID(broker->recvBuf);
-                mqttPubRetuen(broker, MQTT_MSG_PUBREC, mqttMsgID(broker->recvBuf));
+                if(broker->cache)
+                    mqttCacheUpdate(broker->cache, broker->recvBuf);
+                if(broker->flow)
+                    flowCharge(broker->flow, mqttGetMsg(broker->recvBuf, &msg));
+                if(broker->recvCB)
+                {
+                    MQTT_TRACE(broker, MQTT_STAGE_CALLBACK | MQTT_TRACE_BEGIN, MQTT_MSG_PUBLISH, traceID(broker->recvBuf), ret);
+                    broker->recvCB(broker->recvBuf);
+                    MQTT_TRACE(broker, MQTT_STAGE_CALLBACK | MQTT_TRACE_END, MQTT_MSG_PUBLISH, traceID(broker->recvBuf), ret);
+                }
+                delivered = 1;
             }
+            if(2 == MQTTParseMessageQos(broker->recvBuf))
+                broker->seq2 = mqttMsgID(broker->recvBuf);
+            // 超过高水位时应答由 mqttFlowRelease 发送
+            if(!(delivered && broker->flow && flowCheck(broker->flow, ackType, mqttMsgID(broker->recvBuf))) && ackType)
+                ackSend(broker, ackType, mqttMsgID(broker->recvBuf));
         }
         // Qos 2 第二步回复 PUBCOMP
         if(MQTTParseMessageType(broker->recvBuf) == MQTT_MSG_PUBREL)
         {
             broker->seq2 = 0;
-            mqttPubRetuen(broker, MQTT_MSG_PUBCOMP, mqttMsgID(broker->recvBuf));
+            ackSend(broker, MQTT_MSG_PUBCOMP, mqttMsgID(broker->recvBuf));
         }
         // 记得释放内存
-        free(broker->recvBuf);
+        free(packet);
     }
     return ret;
 }
@@ -22,12 +22,137 @@
 #define MQTT_TIMEOUE           3000
 // 报文重传最大次数
 #define MQTT_RETRY             3
+// 非阻塞 socket 上暂时没有数据: mqttRecv/传输层 recv 和 mqttThread 的返回值
+#define MQTT_RECV_AGAIN        (-4)
+// MQTT 5.0 topic 别名表大小 (发送和接收各一张)
+#define MQTT_ALIAS_MAX         16
+// MQTT 5.0 发送时可以设置别名的 topic 最大长度 (接收别名的 topic 不限长度)
+#define MQTT_ALIAS_TOPIC       128
+// 负载编解码器链最多级数
+#define MQTT_CODEC_STAGES      4
+// 负载编解码头最大长度: 每级 1 字节标识 + 最多 4 字节原长度 (与 MQTT 剩余长度相同, 小于 2^28), 加 1 字节结束标志
+#define MQTT_CODEC_HEAD        (MQTT_CODEC_STAGES * 5 + 1)
+// 解码后负载的默认最大长度, MqttCodecChain.maxLen 为 0 时使用
+#define MQTT_CODEC_MAX_LEN     (1 << 20)
+// 编解码缓冲区超过此大小时, 连续 MQTT_CODEC_SHRINK 次只需要小缓冲区后收缩回此大小
+#define MQTT_CODEC_KEEP        (64 << 10)
+#define MQTT_CODEC_SHRINK      16
+// 内置 LZ4 编解码器的标识
+#define MQTT_CODEC_LZ4         1
+// 内置 LZ4 编码器哈希表大小 (以 2 为底的对数)
+#define MQTT_LZ4_HASH_LOG      12
 
+/**
+ * 传输层接口, 位于 MQTT 编解码与 socket 之间 (如 WebSocket, TLS)
+ * 函数语义与 mqttSend/mqttRecv 相同, 第一个参数为 MqttBroker.conn; MqttBroker.socket 仍需设置为底层 socket
+ * send 发送全部数据后返回; recv 在非阻塞 socket 上数据不足时返回 MQTT_RECV_AGAIN, 下次调用从中断处继续
+ * pending 返回传输层已缓冲, 不读 socket 就能收到的字节数 (如 TLS 已解密的记录), 这些数据不会使 socket 可读; 可以为 NULL
+ */
+typedef struct
+{
+    int32_t (*send)(void *conn, const void *data, unsigned int len);
+    int32_t (*recv)(void *conn, void *data, unsigned int len);
+    int32_t (*pending)(void *conn);
+} MqttTransport;
+
+/**
+ * MQTT 5.0 协议状态, 由用户分配 (初始化为 0) 并挂到 MqttBroker.v5 上以启用 5.0 协议
+ * 别名表只在一次连接内有效, mqttConnect 时清空; 不再使用时调用 mqttV5Free
+ */
+typedef struct
+{
+    // 以下由用户设置, 写入 CONNECT 属性, 0 表示不发送该属性
+    uint16_t recvMax;       // Receive Maximum, 允许服务器同时发送的 QoS 1/2 消息数
+    uint32_t maxPacket;     // Maximum Packet Size, 超过此长度的报文不接收
+    uint16_t aliasMax;      // Topic Alias Maximum, 允许服务器使用的别名数, 不超过 MQTT_ALIAS_MAX
+    // 以下由 CONNACK 属性填写
+    uint16_t serverRecvMax;   // 服务器的 Receive Maximum
+    uint32_t serverMaxPacket; // 服务器的 Maximum Packet Size, 0 = 不限制
+    uint16_t serverAliasMax;  // 服务器的 Topic Alias Maximum
+    uint8_t reason;           // 最近一次应答中的原因码
+    uint16_t inflight;        // 已发出但未完成的 QoS 1/2 PUBLISH 数, 由库维护, 不超过 serverRecvMax
+    // 发送别名表, [i] 对应别名 i + 1
+    uint16_t sendAliasCount;
+    uint16_t sendAliasLen[MQTT_ALIAS_MAX];
+    char sendAlias[MQTT_ALIAS_MAX][MQTT_ALIAS_TOPIC];
+    // 接收别名表, [i] 对应别名 i + 1, 长度为 0 表示未使用, topic 按长度分配在堆上
+    uint16_t recvAliasLen[MQTT_ALIAS_MAX];
+    uint16_t recvAliasSize[MQTT_ALIAS_MAX];
+    char *recvAlias[MQTT_ALIAS_MAX];
+    uint16_t recvAliasTopic;  // 本次连接中建立过的最长别名 topic, 决定接收缓冲区的预留空间
+} MqttV5;
+
+/**
+ * 负载编解码器, 多个编解码器通过 next 串成链, 发布时按链表顺序依次编码, 接收时按相反顺序解码
+ * encode/decode 返回输出长度, encode 返回 <= 0 表示放弃本级 (如数据不可压缩)
+ */
+typedef struct MqttCodec
+{
+    uint8_t id;   // 1 ~ 255, 写入负载头, 接收端据此选择解码器
+    int32_t (*encode)(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap);
+    int32_t (*decode)(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap);
+    void *ctx;
+    struct MqttCodec *next;
+} MqttCodec;
+
+/**
+ * 每个连接一份的编解码状态, 由用户分配并挂到 MqttBroker.codec 上, 收发两端必须都启用
+ * 启用后每条负载前都有编解码头: [标识][原长度]...[0], 未编码的负载只多 1 字节
+ */
+typedef struct
+{
+    MqttCodec *codec;     // 编解码器链
+    uint32_t threshold;   // 小于此长度的负载不编码
+    uint32_t maxLen;      // 解码后负载的最大长度, 0 = MQTT_CODEC_MAX_LEN
+    // 以下为复用的缓冲区, 由库管理, 初始化为 0, 不再使用时调用 mqttCodecFree
+    uint8_t *txBuf[2];
+    uint32_t txSize[2];
+    uint8_t *rxBuf[2];
+    uint32_t rxSize[2];
+    uint8_t txSmall[2], rxSmall[2]; // 缓冲区超过 MQTT_CODEC_KEEP 后连续只需要小缓冲区的次数
+} MqttCodecChain;
+
+/**
+ * 内置 LZ4 编码器状态, 作为 MqttCodec.ctx
+ */
+typedef struct
+{
+    uint32_t table[1 << MQTT_LZ4_HASH_LOG];
+} MqttLz4;
+
+/**
+ * 接收流量控制, 由用户分配并挂到 MqttBroker.flow 上
+ * 交给 recvCB 的消息计入未处理量, 应用处理完后调用 mqttFlowRelease;
+ * 未处理量达到高水位时推迟这条消息的 PUBACK/PUBREC 并停止读取 socket, 降到低水位以下时发送推迟的应答并恢复读取.
+ * 停止读取后 TCP 接收窗口填满, 服务器收不到应答也会停止发送 (5.0 的 Receive Maximum)
+ */
 typedef struct
+{
+    // 以下由用户设置, 高水位为 0 表示不限制该项
+    uint32_t maxMsgs, lowMsgs;    // 未处理消息数的高水位和低水位
+    uint32_t maxBytes, lowBytes;  // 未处理负载字节数的高水位和低水位
+    // 以下由库维护, 初始化为 0
+    uint32_t msgs, bytes;
+    volatile uint8_t paused;      // 1 = 已停止读取
+    uint8_t ackType;              // 推迟的应答类型, 0 = 无
+    uint16_t ackID;
+    // 以下成员根据平台对条件变量的要求增减
+    void *conditionVar;
+    void *criticalSection;
+} MqttFlow;
+
+typedef struct MqttBroker MqttBroker;
+
+struct MqttBroker
 {
     void *socket;
+    const MqttTransport *transport; // 传输层, NULL 时直接收发 socket
+    void *conn;                     // 传输层连接对象
     uint8_t *recvBuf;
-    void (*recvCB)(uint8_t *recvBuf);
+    void (*recvCB)(uint8_t *recvBuf);   // 收到推送时调用, 只使用 cache 时可以为 NULL
+    // 收到 PUBACK/PUBREC/PUBCOMP/SUBACK/UNSUBACK 时调用, 在 mqttThread 中执行, 可以为 NULL
+    // reason: 5.0 的原因码; 3.1.1 的 SUBACK 为返回码, 其它为 0
+    void (*ackCB)(MqttBroker *broker, uint8_t type, uint16_t msgID, uint8_t reason);
     const char *clientid;
     const char *username;
     const char *password;
@@ -35,15 +160,33 @@ typedef struct
     // uint8_t willRetain;
     // uint8_t willQos;
     uint8_t cleanSession;
+    MqttV5 *v5;                     // 非 NULL 时使用 MQTT 5.0 协议, 否则使用 3.1.1
+    MqttCodecChain *codec;          // 负载编解码, NULL 时收发原始负载
+    struct MqttCapture *capture;    // 抓包, NULL 时不抓包, 见 libmqttcap.h
+    struct MqttCache *cache;        // 最新值缓存, NULL 时不缓存, 见 libmqttcache.h
+    MqttFlow *flow;                 // 接收流量控制, NULL 时不限制
     // Management fields
     uint16_t seq, seq2;
     uint16_t alive;
-    uint8_t waitType;
+    uint8_t waitType;               // 在 criticalSection 内读写
     uint16_t waitParam;
+    uint8_t nonblock;               // 1 = socket 为非阻塞模式, 报文没有收完时 mqttThread 返回 MQTT_RECV_AGAIN
+    // 接收状态, 非阻塞模式下一个报文可能分多次 mqttThread 收完
+    uint8_t rxHead[5];              // 固定头
+    uint8_t rxHeadLen;
+    uint8_t *rxPacket;              // 正在接收的报文 (含预留空间), NULL = 还在接收固定头
+    uint32_t rxLen, rxTotal;
+    void *engine;                   // 所在引擎的连接状态, 由 libmqttengine.c 维护, NULL = 不在引擎中
+    // mqttThread 发送 PUBACK/PUBREC/PUBCOMP 的函数, 返回 MqttRet; 由 libmqttengine.c 设置 (放入队列, socket 可写时再发送), NULL = 直接发送
+    int (*ackSend)(MqttBroker *broker, uint8_t type, uint16_t msgID);
     // 以下成员根据平台对条件变量的要求增减
+    // 阻塞等待应答时使用, 库在等待和唤醒时自行进入 criticalSection, 调用者不需要持有
     void *conditionVar;
     void *criticalSection;
-} MqttBroker;
+    // 发送锁 (可重入, 如 CRITICAL_SECTION), 一个报文的各部分在锁内连续发送;
+    // 多个线程会同时发送时必须设置 (如 mqttThread 中的应答与其它线程的发布), NULL = 只有一个线程发送
+    void *sendLock;
+};
 
 typedef enum
 {
@@ -56,7 +199,9 @@ typedef enum
     MQTT_PARAM_ERR,        // 输入参数错误
     MQTT_MEM_ERR,          // 内存不足
     MQTT_SEND_ERR,         // socket 发送错误
-    MQTT_ACK_ERR           // 服务器超时无响应
+    MQTT_ACK_ERR,          // 服务器超时无响应
+    MQTT_REASON_ERR,       // MQTT 5.0 服务器返回了失败的原因码, 见 MqttV5.reason
+    MQTT_SIZE_ERR          // 报文超过服务器的 Maximum Packet Size, 或未完成的 QoS 1/2 消息数达到服务器的 Receive Maximum
 } MqttRet;
 
 /**
@@ -112,6 +257,16 @@ extern uint16_t mqttGetTopic(const uint8_t *buf, const uint8_t **ppTopic);
  */
 extern int32_t mqttGetMsg(const uint8_t *buf, const uint8_t **ppMsg);
 
+/**
+ * @brief   检查 topic 名称或 topic 过滤器是否合法
+ *          (合法的 UTF-8, 不含 U+0000, 长度 1 ~ 65535, 通配符位置符合协议 4.7 节)
+ * @param   topic [in] topic 数据, 不要求以 0 结尾
+ * @param   len [in] topic 长度 (以字节为单位)
+ * @param   filter [in] 0 topic 名称 (不允许通配符), 1 topic 过滤器
+ * @return  1 合法, 0 非法
+ */
+extern int mqttCheckTopic(const uint8_t *topic, uint32_t len, uint8_t filter);
+
 /**
  * @brief   连接到 broker
  * @param   broker [in] broker 指针
@@ -142,10 +297,64 @@ extern MqttRet mqttPing(MqttBroker *broker);
  * @param   msg [in] 消息内容
  * @param   retain [in] 是否启用 Retain 标志 (1 启用, 0 禁用)
  * @param   qos [in] (0, 1, 2)
- * @return  参考 MqttRet
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
  */
 extern MqttRet mqttPublish(MqttBroker *broker, const char *topic, const char *msg, uint8_t retain, uint8_t qos);
 
+/**
+ * @brief   向某个 topic 发布二进制消息
+ * @param   broker [in] broker 指针
+ * @param   topic [in] topic 字符串
+ * @param   data [in] 消息内容
+ * @param   len [in] 消息长度
+ * @param   retain [in] 是否启用 Retain 标志 (1 启用, 0 禁用)
+ * @param   qos [in] (0, 1, 2)
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
+ */
+extern MqttRet mqttPublishData(MqttBroker *broker, const char *topic, const void *data, uint32_t len, uint8_t retain, uint8_t qos);
+
+/**
+ * @brief   发布消息但不等待应答, 应答通过 broker->ackCB 通知
+ * @param   broker [in] broker 指针
+ * @param   topic [in] topic 字符串
+ * @param   data [in] 消息内容
+ * @param   len [in] 消息长度
+ * @param   retain [in] 是否启用 Retain 标志 (1 启用, 0 禁用)
+ * @param   qos [in] (0, 1, 2)
+ * @param   msgID [out] 消息 ID, QoS 0 时为 0
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR,
+ *          5.0 未完成的 QoS 1/2 消息达到服务器的 Receive Maximum 时返回 MQTT_SIZE_ERR
+ * @warning 不会重传; QoS 2 收到 PUBREC 后由调用者用 mqttPubRetuen 发送 PUBREL
+ */
+extern MqttRet mqttPublishAsync(MqttBroker *broker, const char *topic, const void *data, uint32_t len, \
+                                uint8_t retain, uint8_t qos, uint16_t *msgID);
+
+/**
+ * @brief   内置 LZ4 块格式编码器, 用作 MqttCodec.encode
+ * @param   ctx [in] MqttLz4 指针
+ * @return  编码后长度, 0 = 超出 cap (数据不可压缩)
+ */
+extern int32_t mqttLz4Encode(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap);
+
+/**
+ * @brief   内置 LZ4 块格式解码器, 用作 MqttCodec.decode
+ * @param   ctx [in] 未使用
+ * @return  解码后长度, < 0 数据格式错误
+ */
+extern int32_t mqttLz4Decode(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap);
+
+/**
+ * @brief   释放编解码缓冲区
+ * @param   chain [in] 编解码状态
+ */
+extern void mqttCodecFree(MqttCodecChain *chain);
+
+/**
+ * @brief   释放 MQTT 5.0 接收别名表
+ * @param   v5 [in] MQTT 5.0 状态
+ */
+extern void mqttV5Free(MqttV5 *v5);
+
 /**
  * @brief   发送特定类型的 publish 响应包
  * @param   broker [in] broker 指针
@@ -157,24 +366,54 @@ extern MqttRet mqttPubRetuen(MqttBroker *broker, uint8_t type, uint16_t msgID);
 /**
  * @brief   订阅某个 topic
  * @param   broker [in] broker 指针
- * @param   topic [in] topic 字符串
- * @return  参考 MqttRet
+ * @param   topic [in] topic 过滤器字符串
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
  */
 extern MqttRet mqttSubscribe(MqttBroker *broker, const char *topic, uint8_t qos);
 
+/**
+ * @brief   订阅某个 topic, 不等待应答, SUBACK 通过 broker->ackCB 通知
+ * @param   broker [in] broker 指针
+ * @param   topic [in] topic 过滤器字符串
+ * @param   msgID [out] 消息 ID
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
+ */
+extern MqttRet mqttSubscribeAsync(MqttBroker *broker, const char *topic, uint8_t qos, uint16_t *msgID);
+
 /**
  * @brief   取消订阅某个 topic
  * @param   broker [in] broker 指针
- * @param   topic [in] topic 字符串
- * @return  参考 MqttRet
+ * @param   topic [in] topic 过滤器字符串
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
  */
 extern MqttRet mqttUnsubscribe(MqttBroker *broker, const char *topic);
 
+/**
+ * @brief   取消订阅某个 topic, 不等待应答, UNSUBACK 通过 broker->ackCB 通知
+ * @param   broker [in] broker 指针
+ * @param   topic [in] topic 过滤器字符串
+ * @param   msgID [out] 消息 ID
+ * @return  参考 MqttRet, topic 不合法时返回 MQTT_PARAM_ERR
+ */
+extern MqttRet mqttUnsubscribeAsync(MqttBroker *broker, const char *topic, uint16_t *msgID);
+
+/**
+ * @brief   应用处理完一条推送后调用 (线程安全), 未处理量降到低水位以下时恢复读取
+ * @param   broker [in] broker 指针
+ * @param   len [in] 该消息的负载长度 (mqttGetMsg 的返回值)
+ * @return  参考 MqttRet, 没有设置 broker->flow 时返回 MQTT_PARAM_ERR, 发送推迟的应答失败时返回 MQTT_SEND_ERR
+ */
+extern MqttRet mqttFlowRelease(MqttBroker *broker, uint32_t len);
+
 /**
  * @brief   mqtt 报文接收与响应业务
  * @param   broker [in] broker 指针
- * @return  参考 MqttRet
- * @warning 创建 TCP 连接后应立即在新线程中循环调用
+ * @return  >0 成功并返回报文长度, 0 连接已关闭, -1 IO 错误, -2 内存不足,
+ *          -3 协议错误 (如 PUBLISH 报文格式错误或 topic 不合法),
+ *          MQTT_RECV_AGAIN (-4) 只在 broker->nonblock 为 1 时返回, 报文没有收完或已停止读取, socket 可读后再调用;
+ *          除 MQTT_RECV_AGAIN 外, 返回值 <= 0 时应关闭连接
+ * @warning 创建 TCP 连接后应立即在新线程中循环调用;
+ *          设置了 broker->flow 且已停止读取时, 阻塞到 mqttFlowRelease 恢复读取 (非阻塞模式下返回 MQTT_RECV_AGAIN)
  */
 extern int mqttThread(MqttBroker *broker);
 
@@ -0,0 +1,510 @@
+#ifndef __LIBMQTT_HPP
+#define __LIBMQTT_HPP
+
+/**
+ * C++20 封装 (只有头文件)
+ * - Client 只能移动, 析构时关闭 socket, 等待接收线程退出, 未完成的操作以 MQTT_SEND_ERR 恢复,
+ *   然后释放同步对象, 编解码缓冲区和 5.0 别名表
+ * - publish/subscribe/unsubscribe 返回 awaitable, co_await 时只发送一次, 收到应答后在 poll() 线程中恢复协程,
+ *   不占用等待线程, 少量线程即可同时处理大量未完成的发布
+ * - 收到的推送以 Message 的形式交给 handler, topic 和负载直接指向接收缓冲区, 不复制
+ *
+ * 使用方法:
+ *     mqtt::Client client(socket, "clientid");
+ *     client.onMessage([](const mqtt::Message &m) { ... });
+ *     client.start();     // 启动接收线程, 也可以自己在另一个线程中循环调用 poll()
+ *     client.connect();
+ *     MqttRet ret = co_await client.publish("tp/aa", std::as_bytes(std::span(buf)), 1);
+ */
+
+#include <windows.h>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "libmqtt.h"
+}
+
+namespace mqtt
+{
+
+/**
+ * 收到的推送, 只在 handler 调用期间有效
+ */
+struct Message
+{
+    std::string_view topic;
+    std::span<const std::byte> payload;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+};
+
+class Client;
+
+// 每个连接最多同时等待应答的操作数, 超过时 co_await 的结果为 MQTT_SIZE_ERR
+constexpr std::size_t maxInflight = 1024;
+
+namespace detail
+{
+
+struct Operation;
+
+/**
+ * 一个等待应答的操作
+ */
+struct Pending
+{
+    Operation *op;
+    uint8_t type;   // 期望的应答类型
+    bool sending;   // 发送还没有返回, 此时完成的操作由发起线程继续执行, 不在 poll() 中恢复
+};
+
+/**
+ * 连接状态, 地址固定, Client 移动时不变
+ */
+struct State
+{
+    MqttBroker broker{};
+    CRITICAL_SECTION criticalSection;
+    CONDITION_VARIABLE conditionVar;
+    CRITICAL_SECTION sendLock;
+    std::string clientid, username, password;
+    // 串行发起操作 (broker->seq, 别名表和编解码缓冲区不是线程安全的), 发送期间持有; poll() 线程中不使用
+    std::mutex seqLock;
+    // 保护 pending 和 ready, 只短暂持有, 不在锁内发送
+    std::mutex lock;
+    std::unordered_map<uint16_t, Pending> pending;
+    // 已收到应答, 等待在 poll() 中恢复的协程
+    std::vector<std::coroutine_handle<>> ready;
+    std::function<void(const Message&)> handler;
+    // 已关闭, 之后发起的操作直接以 MQTT_SEND_ERR 结束; 在 lock 内访问
+    bool closed = false;
+    // start() 启动的接收线程
+    std::thread poller;
+
+    State()
+    {
+        InitializeCriticalSection(&criticalSection);
+        InitializeConditionVariable(&conditionVar);
+        InitializeCriticalSection(&sendLock);
+        broker.criticalSection = &criticalSection;
+        broker.conditionVar = &conditionVar;
+        broker.sendLock = &sendLock;
+    }
+
+    ~State()
+    {
+        if(broker.codec)
+            mqttCodecFree(broker.codec);
+        if(broker.v5)
+            mqttV5Free(broker.v5);
+        DeleteCriticalSection(&sendLock);
+        DeleteCriticalSection(&criticalSection);
+    }
+
+    State(const State&) = delete;
+    State &operator=(const State&) = delete;
+
+    // 正在执行 mqttThread 的连接, 供 C 回调找到对应的 State
+    static State *&current()
+    {
+        static thread_local State *state = nullptr;
+        return state;
+    }
+
+    /**
+     * @brief   结束等待应答的操作, 需要持有 lock
+     * @param   result [in] 操作的结果
+     */
+    void finish(std::unordered_map<uint16_t, Pending>::iterator it, MqttRet result);
+
+    /**
+     * @brief   接收一个报文并恢复已收到应答的协程, 见 Client::poll()
+     */
+    int poll();
+
+    /**
+     * @brief   结束所有未完成的操作并在本线程中恢复, 之后发起的操作直接失败
+     * @param   closing [in] true = 连接已关闭, 不再接受新的操作
+     */
+    void fail(bool closing);
+
+    static void recvCB(uint8_t *recvBuf);
+    static void ackCB(MqttBroker *broker, uint8_t type, uint16_t msgID, uint8_t reason);
+};
+
+/**
+ * publish/subscribe/unsubscribe 共用的 awaitable
+ */
+struct Operation
+{
+    enum Kind { PUBLISH, SUBSCRIBE, UNSUBSCRIBE };
+
+    State *state;
+    Kind kind;
+    const char *topic;
+    std::span<const std::byte> data;
+    uint8_t qos;
+    uint8_t retain;
+    MqttRet result = MQTT_OK;
+    std::coroutine_handle<> handle;
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    /**
+     * @brief   登记等待应答后发送报文
+     * @return  false 不挂起 (QoS 0 或发送失败), true 挂起到收到应答
+     * @note    应答可能在发送返回之前到达, 此时不挂起, 直接在本线程中继续执行协程;
+     *          发送期间报文内容 (协程帧中的数据) 仍被访问, 不能让 poll() 线程提前恢复协程
+     */
+    bool await_suspend(std::coroutine_handle<> h)
+    {
+        std::lock_guard<std::mutex> seqGuard(state->seqLock);
+        MqttBroker *broker = &state->broker;
+        uint16_t msgID = 0, id;
+        uint8_t type;
+        MqttRet ret;
+
+        if(PUBLISH == kind && !qos)
+        {
+            result = mqttPublishAsync(broker, topic, data.data(), data.size(), retain, 0, &msgID);
+            return false;
+        }
+        type = (PUBLISH == kind) ? ((2 == qos) ? MQTT_MSG_PUBREC : MQTT_MSG_PUBACK) \
+                                 : ((SUBSCRIBE == kind) ? MQTT_MSG_SUBACK : MQTT_MSG_UNSUBACK);
+        {
+            // 在发送之前登记, 跳过仍在等待应答的消息 ID (序号回绕)
+            std::lock_guard<std::mutex> guard(state->lock);
+            if(state->closed)
+            {
+                result = MQTT_SEND_ERR;
+                return false;
+            }
+            if(state->pending.size() >= maxInflight)
+            {
+                result = MQTT_SIZE_ERR;
+                return false;
+            }
+            while(!broker->seq || state->pending.count(broker->seq))
+                broker->seq++;
+            id = broker->seq; // 下面的 C 接口使用 broker->seq 作为消息 ID
+            handle = h;
+            state->pending[id] = Pending{this, type, true};
+        }
+        // 发送时不持有 lock, 否则发送阻塞时 poll() 线程在 ackCB 中等锁, 无法继续接收
+        switch(kind)
+        {
+        case PUBLISH:
+            ret = mqttPublishAsync(broker, topic, data.data(), data.size(), retain, qos, &msgID);
+            break;
+        case SUBSCRIBE:
+            ret = mqttSubscribeAsync(broker, topic, qos, &msgID);
+            break;
+        default:
+            ret = mqttUnsubscribeAsync(broker, topic, &msgID);
+            break;
+        }
+        std::lock_guard<std::mutex> guard(state->lock);
+        auto it = state->pending.find(id);
+        if(it == state->pending.end() || it->second.op != this)
+            return false; // 发送期间已收到应答或连接已断开, result 已设置
+        if(MQTT_OK != ret)
+        {
+            state->pending.erase(it);
+            result = ret;
+            return false;
+        }
+        it->second.sending = false;
+        return true;
+    }
+
+    MqttRet await_resume() const noexcept
+    {
+        return result;
+    }
+};
+
+inline void State::recvCB(uint8_t *recvBuf)
+{
+    State *state = current();
+    const uint8_t *topic, *msg;
+    uint16_t topicLen;
+    int32_t msgLen;
+
+    if(!state || !state->handler)
+        return;
+    topicLen = mqttGetTopic(recvBuf, &topic);
+    msgLen = mqttGetMsg(recvBuf, &msg);
+    state->handler(Message{
+        std::string_view(reinterpret_cast<const char*>(topic), topicLen),
+        std::span<const std::byte>(reinterpret_cast<const std::byte*>(msg), msgLen),
+        static_cast<uint8_t>(MQTTParseMessageQos(recvBuf)),
+        MQTTParseMessageRetain(recvBuf) != 0,
+        MQTTParseMessageDuplicate(recvBuf) != 0
+    });
+}
+
+inline void State::finish(std::unordered_map<uint16_t, Pending>::iterator it, MqttRet result)
+{
+    Operation *op = it->second.op;
+
+    op->result = result;
+    if(!it->second.sending)
+        ready.push_back(op->handle);
+    pending.erase(it);
+}
+
+inline int State::poll()
+{
+    int ret;
+
+    current() = this;
+    ret = mqttThread(&broker);
+    current() = nullptr;
+    // 非阻塞模式下报文没有收完, 连接仍然有效
+    if(ret <= 0 && MQTT_RECV_AGAIN != ret)
+        fail(false);
+    else
+    {
+        std::vector<std::coroutine_handle<>> resume;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            resume.swap(ready);
+        }
+        // 在锁外恢复, 协程可以立即发起下一个操作
+        for(auto h : resume)
+            h.resume();
+    }
+    return ret;
+}
+
+inline void State::fail(bool closing)
+{
+    std::vector<std::coroutine_handle<>> resume;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = closed || closing;
+        while(!pending.empty())
+            finish(pending.begin(), MQTT_SEND_ERR);
+        resume.swap(ready);
+    }
+    for(auto h : resume)
+        h.resume();
+}
+
+inline void State::ackCB(MqttBroker *broker, uint8_t type, uint16_t msgID, uint8_t reason)
+{
+    State *state = current();
+
+    if(!state || &state->broker != broker)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        auto it = state->pending.find(msgID);
+        // 不是本层发出的请求 (例如阻塞的 C 接口) 或类型不符时忽略
+        if(it == state->pending.end() || it->second.type != type)
+            return;
+        if(MQTT_MSG_PUBREC == type && reason < 0x80)
+            it->second.type = MQTT_MSG_PUBCOMP; // QoS 2 第二步: 在锁外发送 PUBREL, 继续等待 PUBCOMP
+        else
+        {
+            state->finish(it, (reason >= 0x80) ? MQTT_REASON_ERR : MQTT_OK);
+            return;
+        }
+    }
+    if(MQTT_OK == mqttPubRetuen(broker, MQTT_MSG_PUBREL | 0x02, msgID)) // PUBREL 固定头保留位为 0010
+        return;
+    std::lock_guard<std::mutex> guard(state->lock);
+    auto it = state->pending.find(msgID);
+    if(it != state->pending.end() && MQTT_MSG_PUBCOMP == it->second.type)
+        state->finish(it, MQTT_SEND_ERR);
+}
+
+} // namespace detail
+
+/**
+ * MQTT 连接, 只能移动
+ */
+class Client
+{
+public:
+    /**
+     * @param   socket [in] 已建立的 TCP 连接, 由 Client 负责关闭
+     * @param   clientid [in] 客户端 ID
+     * @param   alive [in] 心跳间隔 (秒)
+     */
+    Client(void *socket, std::string_view clientid, uint16_t alive = 30) : state(std::make_unique<detail::State>())
+    {
+        state->clientid = clientid;
+        state->broker.socket = socket;
+        state->broker.clientid = state->clientid.c_str();
+        state->broker.alive = alive;
+        state->broker.seq = 1;
+        state->broker.cleanSession = 1;
+        state->broker.recvCB = detail::State::recvCB;
+        state->broker.ackCB = detail::State::ackCB;
+    }
+
+    ~Client()
+    {
+        close();
+    }
+
+    Client(Client&&) noexcept = default;
+    Client &operator=(Client &&other) noexcept
+    {
+        if(this != &other)
+        {
+            close();
+            state = std::move(other.state);
+        }
+        return *this;
+    }
+    Client(const Client&) = delete;
+    Client &operator=(const Client&) = delete;
+
+    /**
+     * @brief   设置用户名和密码, 在 connect 前调用
+     */
+    void credentials(std::string_view username, std::string_view password)
+    {
+        state->username = username;
+        state->password = password;
+        state->broker.username = state->username.c_str();
+        state->broker.password = state->password.c_str();
+    }
+
+    /**
+     * @brief   设置收到推送时的处理函数, 在 poll() 线程中调用
+     */
+    void onMessage(std::function<void(const Message&)> handler)
+    {
+        state->handler = std::move(handler);
+    }
+
+    /**
+     * @brief   底层 broker, 用于设置 transport/v5/codec 等高级选项, 在 connect 前调用
+     * @warning 不要修改 recvCB, ackCB 和同步对象
+     */
+    MqttBroker &broker() noexcept
+    {
+        return state->broker;
+    }
+
+    /**
+     * @brief   连接服务器 (阻塞), 需要另一个线程在调用 poll()
+     * @return  参考 MqttRet
+     */
+    MqttRet connect()
+    {
+        return mqttConnect(&state->broker);
+    }
+
+    MqttRet disconnect()
+    {
+        std::lock_guard<std::mutex> guard(state->seqLock);
+        return mqttDisconnect(&state->broker);
+    }
+
+    MqttRet ping()
+    {
+        std::lock_guard<std::mutex> guard(state->seqLock);
+        return mqttPing(&state->broker);
+    }
+
+    /**
+     * @brief   启动接收线程, 循环调用 poll() 直到连接断开; 析构时关闭 socket 并等待该线程退出
+     * @warning 只调用一次, 之后不要再自己调用 poll()
+     */
+    void start()
+    {
+        state->poller = std::thread([s = state.get()]
+        {
+            int ret;
+
+            do
+                ret = s->poll();
+            while(ret > 0 || MQTT_RECV_AGAIN == ret);
+        });
+    }
+
+    /**
+     * @brief   接收一个报文, 调用 handler, 然后恢复已收到应答的协程
+     * @return  同 mqttThread, MQTT_RECV_AGAIN 以外 <= 0 时所有未完成的操作以 MQTT_SEND_ERR 结束
+     * @warning 不使用 start() 而自己调用时, 析构 Client 之前 poll() 必须已经返回并且不再调用
+     */
+    int poll()
+    {
+        return state->poll();
+    }
+
+    /**
+     * @brief   发布消息, co_await 的结果为 MqttRet
+     * @param   topic [in] topic 字符串, co_await 完成前有效
+     * @param   payload [in] 消息内容, co_await 完成前有效
+     * @param   qos [in] (0, 1, 2), QoS 0 发送后立即完成
+     * @param   retain [in] 是否启用 Retain 标志
+     * @warning 不会重传, 服务器不应答时协程在连接断开前不会恢复; 未完成的操作达到 maxInflight 时结果为 MQTT_SIZE_ERR
+     */
+    detail::Operation publish(const char *topic, std::span<const std::byte> payload, uint8_t qos = 0, bool retain = false)
+    {
+        return detail::Operation{state.get(), detail::Operation::PUBLISH, topic, payload, qos, retain, MQTT_OK, {}};
+    }
+
+    /**
+     * @brief   订阅 topic, co_await 的结果为 MqttRet, 服务器拒绝时为 MQTT_REASON_ERR
+     */
+    detail::Operation subscribe(const char *topic, uint8_t qos = 0)
+    {
+        return detail::Operation{state.get(), detail::Operation::SUBSCRIBE, topic, {}, qos, 0, MQTT_OK, {}};
+    }
+
+    /**
+     * @brief   取消订阅 topic, co_await 的结果为 MqttRet
+     */
+    detail::Operation unsubscribe(const char *topic)
+    {
+        return detail::Operation{state.get(), detail::Operation::UNSUBSCRIBE, topic, {}, 0, 0, MQTT_OK, {}};
+    }
+
+private:
+    /**
+     * @brief   断开连接: 先关闭 socket 的收发让接收线程退出, 等它退出后再恢复剩下的操作, 最后释放 socket
+     * @note    恢复的协程中发起的新操作直接以 MQTT_SEND_ERR 结束
+     */
+    void close() noexcept
+    {
+        if(!state)
+            return;
+        if(state->broker.socket)
+            shutdown((SOCKET)state->broker.socket, SD_BOTH);
+        if(state->poller.joinable())
+            state->poller.join();
+        state->fail(true);
+        if(state->broker.socket)
+            closesocket((SOCKET)state->broker.socket);
+        state->broker.socket = nullptr;
+    }
+
+    std::unique_ptr<detail::State> state;
+};
+
+} // namespace mqtt
+
+#endif // __LIBMQTT_HPP
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "libmqttcache.h"
+
+/**
+ * 哈希表中的一项, topic 写入一次后不再改变, 项也不会删除
+ * 读取方与写线程之间的同步 (类似 seqlock, 但有两块缓冲区):
+ *     version 每次更新加 2, 当前值在 ((version >> 1) & 1) 号缓冲区;
+ *     version 为奇数表示正在写入另一块缓冲区, 当前值仍然可读
+ */
+typedef struct
+{
+    _Atomic(const uint8_t*) topic;  // NULL = 空槽
+    uint32_t hash;
+    uint16_t topicLen;
+    atomic_uint version;
+    _Atomic(uint8_t*) buf[2];       // NULL = 没有值
+    atomic_uint len[2];
+    atomic_uchar retain[2];
+    uint32_t cap[2];                // 只有写线程访问
+} CacheEntry;
+
+struct MqttCache
+{
+    CacheEntry *entries;
+    uint32_t mask;
+    uint32_t count, max;
+    // 内存池, 只增不减, 只有写线程访问
+    uint8_t *arena;
+    uint32_t arenaSize, arenaUsed;
+    // 负载变大后换下的旧缓冲区, 按容量 (MQTT_CACHE_MIN_BUF << i) 分成空闲链表, 链表指针存放在缓冲区开头
+    uint8_t *freeBufs[32];
+    atomic_uint overflow;
+};
+
+/**
+ * @brief   FNV-1a 哈希
+ */
+static uint32_t topicHash(const uint8_t *topic, uint16_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while(len--)
+    {
+        hash ^= *topic++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief   从内存池分配 (8 字节对齐)
+ * @return  内存池耗尽返回 NULL
+ */
+static uint8_t *arenaAlloc(MqttCache *cache, uint32_t size)
+{
+    uint8_t *p;
+
+    size = (size + 7) & ~7u;
+    if(size > cache->arenaSize - cache->arenaUsed)
+        return NULL;
+    p = cache->arena + cache->arenaUsed;
+    cache->arenaUsed += size;
+    return p;
+}
+
+/**
+ * @brief   分配负载缓冲区, 先从同样容量的空闲链表中取
+ * @param   cap [in] 容量, MQTT_CACHE_MIN_BUF 的 2 的幂倍
+ * @return  内存池耗尽返回 NULL
+ */
+static uint8_t *bufAlloc(MqttCache *cache, uint32_t cap)
+{
+    uint32_t i;
+    uint8_t *p;
+
+    for(i = 0; (MQTT_CACHE_MIN_BUF << i) < cap; i++);
+    p = cache->freeBufs[i];
+    if(!p)
+        return arenaAlloc(cache, cap);
+    memcpy(&cache->freeBufs[i], p, sizeof(uint8_t*));
+    return p;
+}
+
+/**
+ * @brief   把换下的负载缓冲区放回空闲链表
+ * @note    调用时该项的 version 已经是奇数, 还在读这块缓冲区的读取方校验会失败, 复用不影响它们
+ */
+static void bufFree(MqttCache *cache, uint8_t *p, uint32_t cap)
+{
+    uint32_t i;
+
+    for(i = 0; (MQTT_CACHE_MIN_BUF << i) < cap; i++);
+    memcpy(p, &cache->freeBufs[i], sizeof(uint8_t*));
+    cache->freeBufs[i] = p;
+}
+
+/**
+ * @brief   线性探测查找 topic
+ * @return  topic 所在的项, 不存在时返回探测结束的空槽
+ */
+static CacheEntry *cacheSlot(MqttCache *cache, const uint8_t *topic, uint16_t len, uint32_t hash)
+{
+    CacheEntry *e;
+    const uint8_t *t;
+    uint32_t i;
+
+    // 项数不超过槽数的 3/4, 一定能遇到空槽
+    for(i = hash & cache->mask; ; i = (i + 1) & cache->mask)
+    {
+        e = &cache->entries[i];
+        t = atomic_load_explicit(&e->topic, memory_order_acquire);
+        if(!t || (e->hash == hash && e->topicLen == len && !memcmp(t, topic, len)))
+            return e;
+    }
+}
+
+MqttCache *mqttCacheCreate(uint32_t slots, uint32_t arenaSize)
+{
+    MqttCache *cache;
+
+    if(slots < 4 || (slots & (slots - 1)))
+        return NULL;
+    cache = calloc(1, sizeof(MqttCache));
+    if(!cache)
+        return NULL;
+    cache->entries = calloc(slots, sizeof(CacheEntry));
+    cache->arena = malloc(arenaSize);
+    if(!cache->entries || !cache->arena)
+    {
+        free(cache->entries);
+        free(cache->arena);
+        free(cache);
+        return NULL;
+    }
+    cache->mask = slots - 1;
+    cache->max = slots / 4 * 3;
+    cache->arenaSize = arenaSize;
+    return cache;
+}
+
+void mqttCacheDestroy(MqttCache *cache)
+{
+    free(cache->entries);
+    free(cache->arena);
+    free(cache);
+}
+
+void mqttCacheUpdate(MqttCache *cache, const uint8_t *recvBuf)
+{
+    const uint8_t *topic, *msg;
+    uint8_t *t, *p;
+    uint16_t topicLen;
+    uint32_t hash, v, idx, cap;
+    int32_t len;
+    CacheEntry *e;
+
+    topicLen = mqttGetTopic(recvBuf, &topic);
+    len = mqttGetMsg(recvBuf, &msg);
+    hash = topicHash(topic, topicLen);
+    e = cacheSlot(cache, topic, topicLen, hash);
+    if(!atomic_load_explicit(&e->topic, memory_order_relaxed))
+    {
+        // 新 topic: 填好各字段后再发布 topic 指针
+        if(cache->count >= cache->max || !(t = arenaAlloc(cache, topicLen)))
+        {
+            atomic_fetch_add_explicit(&cache->overflow, 1, memory_order_relaxed);
+            return;
+        }
+        memcpy(t, topic, topicLen);
+        e->hash = hash;
+        e->topicLen = topicLen;
+        atomic_store_explicit(&e->topic, t, memory_order_release);
+        cache->count++;
+    }
+    // 写入另一块缓冲区, 读取方正在读的当前值不受影响
+    v = atomic_load_explicit(&e->version, memory_order_relaxed);
+    idx = ((v >> 1) + 1) & 1;
+    atomic_store_explicit(&e->version, v + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    p = atomic_load_explicit(&e->buf[idx], memory_order_relaxed);
+    if((uint32_t)len > e->cap[idx] || !p)
+    {
+        // 旧缓冲区给以后同样大小的缓冲区复用 (可能是其它 topic)
+        if(p)
+            bufFree(cache, p, e->cap[idx]);
+        for(cap = MQTT_CACHE_MIN_BUF; cap < (uint32_t)len; cap <<= 1);
+        p = bufAlloc(cache, cap);
+        e->cap[idx] = p ? cap : 0;
+        if(!p)
+            atomic_fetch_add_explicit(&cache->overflow, 1, memory_order_relaxed);
+    }
+    if(p)
+        memcpy(p, msg, len);
+    atomic_store_explicit(&e->buf[idx], p, memory_order_relaxed);
+    atomic_store_explicit(&e->len[idx], len, memory_order_relaxed);
+    atomic_store_explicit(&e->retain[idx], MQTTParseMessageRetain(recvBuf), memory_order_relaxed);
+    atomic_store_explicit(&e->version, v + 2, memory_order_release);
+}
+
+int mqttCacheValidate(const MqttCacheView *view)
+{
+    const CacheEntry *e = view->entry;
+
+    // 当前缓冲区在 version 达到 (view->version & ~1) + 3 时才开始被改写
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&e->version, memory_order_relaxed) - (view->version & ~1u) <= 2;
+}
+
+int mqttCacheLookup(MqttCache *cache, const uint8_t *topic, uint16_t len, MqttCacheView *view)
+{
+    CacheEntry *e;
+    uint32_t idx;
+
+    e = cacheSlot(cache, topic, len, topicHash(topic, len));
+    if(!atomic_load_explicit(&e->topic, memory_order_relaxed))
+        return 0;
+    view->entry = e;
+    // 缓冲区指针和长度必须来自同一次更新
+    do {
+        view->version = atomic_load_explicit(&e->version, memory_order_acquire);
+        idx = (view->version >> 1) & 1;
+        view->data = atomic_load_explicit(&e->buf[idx], memory_order_relaxed);
+        view->len = atomic_load_explicit(&e->len[idx], memory_order_relaxed);
+        view->retain = atomic_load_explicit(&e->retain[idx], memory_order_relaxed);
+    } while(!mqttCacheValidate(view));
+    return view->data != NULL;
+}
+
+int32_t mqttCacheGet(MqttCache *cache, const uint8_t *topic, uint16_t len, \
+                     void *buf, uint32_t size, uint8_t *retain)
+{
+    MqttCacheView view;
+
+    for(;;)
+    {
+        if(!mqttCacheLookup(cache, topic, len, &view))
+            return -1;
+        if(view.len > size)
+            return -2;
+        memcpy(buf, view.data, view.len);
+        if(mqttCacheValidate(&view))
+            break;
+    }
+    if(retain)
+        *retain = view.retain;
+    return view.len;
+}
+
+uint32_t mqttCacheOverflow(MqttCache *cache)
+{
+    return atomic_load_explicit(&cache->overflow, memory_order_relaxed);
+}
@@ -0,0 +1,88 @@
+#ifndef __LIBMQTTCACHE_H
+#define __LIBMQTTCACHE_H
+
+#include "libmqtt.h"
+
+// 负载缓冲区的最小容量, 容量按 2 的幂增长
+#define MQTT_CACHE_MIN_BUF     16
+
+/**
+ * 最新值缓存: topic -> 最新的负载和 Retain 标志
+ * 令 broker->cache 指向缓存后, mqttThread 在调用 recvCB 之前更新缓存.
+ * topic 和负载都放在创建时分配的内存池中, 更新时不再 malloc; 每个 topic 两块负载缓冲区轮流写入,
+ * 读取方无锁, 正在读的值在下一次更新期间仍然有效. 负载变长时换下的旧缓冲区留给以后同样大小的缓冲区复用.
+ * 只允许一个线程更新: 共用一个缓存的所有 broker 必须由同一个线程调用 mqttThread (如引擎的同一分片).
+ */
+typedef struct MqttCache MqttCache;
+
+/**
+ * 无复制读取的结果, 数据直接指向缓存内部
+ */
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t len;
+    uint8_t retain;
+    const void *entry;   // 内部使用
+    uint32_t version;    // 内部使用
+} MqttCacheView;
+
+/**
+ * @brief   创建缓存
+ * @param   slots [in] 哈希表槽数, 必须是 2 的幂, 最多缓存 slots * 3 / 4 个 topic
+ * @param   arenaSize [in] 内存池大小 (字节), 存放 topic 和负载; 每个 topic 约占 topic 长度 + 2 块负载缓冲区,
+ *                     缓冲区容量是不小于负载长度的 2 的幂 (至少 MQTT_CACHE_MIN_BUF), 负载变长时另外还要容纳更大的两块
+ * @return  缓存指针, 失败返回 NULL
+ */
+extern MqttCache *mqttCacheCreate(uint32_t slots, uint32_t arenaSize);
+
+/**
+ * @brief   释放缓存
+ * @warning 调用前先将 broker->cache 置为 NULL, 并确保没有线程还在读取
+ */
+extern void mqttCacheDestroy(MqttCache *cache);
+
+/**
+ * @brief   用收到的 PUBLISH 报文更新缓存, 由 mqttThread 调用
+ * @param   cache [in] 缓存指针
+ * @param   recvBuf [in] PUBLISH 报文 (负载已解码)
+ * @note    哈希表已满或内存池耗尽时该 topic 不再有缓存值 (查询返回 0), 并计入 mqttCacheOverflow
+ */
+extern void mqttCacheUpdate(MqttCache *cache, const uint8_t *recvBuf);
+
+/**
+ * @brief   无复制查询, 任意线程可调用
+ * @param   cache [in] 缓存指针
+ * @param   topic [in] topic 名称
+ * @param   len [in] topic 长度
+ * @param   view [out] 查询结果
+ * @return  1 找到, 0 没有缓存值
+ * @warning 使用完 view->data 后必须调用 mqttCacheValidate, 返回 0 时读到的数据可能已被改写, 应当丢弃并重新查询
+ */
+extern int mqttCacheLookup(MqttCache *cache, const uint8_t *topic, uint16_t len, MqttCacheView *view);
+
+/**
+ * @brief   检查 view 读到的数据是否完整
+ * @return  1 完整, 0 期间缓存被更新了两次以上, 数据可能已被改写
+ */
+extern int mqttCacheValidate(const MqttCacheView *view);
+
+/**
+ * @brief   查询并复制负载, 任意线程可调用
+ * @param   cache [in] 缓存指针
+ * @param   topic [in] topic 名称
+ * @param   len [in] topic 长度
+ * @param   buf [out] 负载缓冲区
+ * @param   size [in] 缓冲区大小
+ * @param   retain [out] Retain 标志, 可以为 NULL
+ * @return  负载长度, -1 没有缓存值, -2 缓冲区太小 (不复制)
+ */
+extern int32_t mqttCacheGet(MqttCache *cache, const uint8_t *topic, uint16_t len, \
+                            void *buf, uint32_t size, uint8_t *retain);
+
+/**
+ * @brief   因哈希表已满或内存池耗尽而没有缓存的更新次数
+ */
+extern uint32_t mqttCacheOverflow(MqttCache *cache);
+
+#endif // __LIBMQTTCACHE_H
@@ -0,0 +1,465 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <windows.h>
+#include <pthread.h>
+#include "libmqttcap.h"
+
+extern uint64_t mqttTimeUs(void);
+
+// 环形缓冲区中的记录按 32 字节对齐, 记录头占一个对齐单位, 不会跨越缓冲区末尾
+#define CAP_ALIGN    32
+#define CAP_MAGIC    "MQCP"
+#define CAP_VERSION  1
+// 写线程连接号表的初始大小, 必须是 2 的幂
+#define CAP_CONN_MIN 16
+
+/**
+ * 环形缓冲区中的记录头, 后面紧跟 len 字节数据 (可能绕回缓冲区开头)
+ */
+typedef struct
+{
+    atomic_uint ready;   // 0 = 未提交, 否则 1 | (方向 << 1)
+    uint32_t len;
+    uint64_t time;
+    const void *conn;
+} CapHead;
+
+_Static_assert(sizeof(CapHead) <= CAP_ALIGN, "CapHead must fit in CAP_ALIGN");
+
+/**
+ * 写线程的连接号表, 开放寻址, 连接指针 -> 连接号
+ */
+typedef struct
+{
+    const void *conn;
+    uint32_t id;
+} CapConn;
+
+struct MqttCapture
+{
+    FILE *file;
+    uint8_t *ring;
+    uint32_t size;
+    // 生产者用 CAS 移动 head 预留空间, 写线程消费后移动 tail
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    atomic_uint dropped;
+    atomic_int run;
+    pthread_t thread;
+    // 以下只有写线程访问
+    uint64_t last;
+    uint8_t *scratch;
+    uint32_t scratchSize;
+    CapConn *conns;
+    uint32_t connSize;   // conns 的容量, 2 的幂
+    uint32_t connCount;
+};
+
+struct MqttReplay
+{
+    uint8_t *data;       // 所有收到的报文首尾相接
+    uint32_t *ends;      // 每条记录在 data 中的结束位置
+    uint64_t *times;     // 每条记录的时间
+    uint32_t count;
+    // 回放状态
+    uint32_t rec, pos;
+    uint8_t paced;
+    uint64_t start;
+};
+
+/**
+ * @brief   记录在环形缓冲区中占用的字节数
+ */
+static uint32_t capSpan(uint32_t len)
+{
+    return CAP_ALIGN + ((len + CAP_ALIGN - 1) & ~(CAP_ALIGN - 1));
+}
+
+/**
+ * @brief   写入环形缓冲区, 处理绕回
+ */
+static void ringWrite(MqttCapture *cap, uint64_t at, const void *data, uint32_t len)
+{
+    uint32_t off = at & (cap->size - 1);
+    uint32_t first = (len < cap->size - off) ? len : cap->size - off;
+
+    memcpy(cap->ring + off, data, first);
+    memcpy(cap->ring, (const uint8_t*)data + first, len - first);
+}
+
+/**
+ * @brief   从环形缓冲区读出, 处理绕回
+ */
+static void ringRead(MqttCapture *cap, uint64_t at, void *data, uint32_t len)
+{
+    uint32_t off = at & (cap->size - 1);
+    uint32_t first = (len < cap->size - off) ? len : cap->size - off;
+
+    memcpy(data, cap->ring + off, first);
+    memcpy((uint8_t*)data + first, cap->ring, len - first);
+}
+
+void mqttCapture(MqttCapture *cap, const void *conn, uint8_t dir, const void *data, uint32_t len)
+{
+    uint32_t need = capSpan(len);
+    uint64_t head, time;
+    CapHead *h;
+
+    // 在预留空间之前取时间, 预留顺序靠后的记录时间不会早太多, 写线程再把剩余的倒退截为 0
+    time = mqttTimeUs();
+    // 预留空间: 与写线程之间只通过 tail 同步, acquire 保证写线程已经读完这段空间
+    head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    do {
+        if(head + need - atomic_load_explicit(&cap->tail, memory_order_acquire) > cap->size)
+        {
+            atomic_fetch_add_explicit(&cap->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&cap->head, &head, head + need, \
+                                                   memory_order_relaxed, memory_order_relaxed));
+    h = (CapHead*)(cap->ring + (head & (cap->size - 1)));
+    h->len = len;
+    h->time = time;
+    h->conn = conn;
+    ringWrite(cap, head + CAP_ALIGN, data, len);
+    // 提交, release 保证写线程看到完整的记录
+    atomic_store_explicit(&h->ready, 1 | (dir << 1), memory_order_release);
+}
+
+/**
+ * @brief   按 MQTT 剩余长度的格式写入变长整数
+ */
+static void writeVarint(FILE *file, uint64_t v)
+{
+    for(; v >= 0x80; v >>= 7)
+        fputc((v & 0x7F) | 0x80, file);
+    fputc(v, file);
+}
+
+/**
+ * @brief   查找连接号, 第一次出现的连接分配新号
+ * @return  连接号, 内存不足返回 0
+ * @note    只在写线程调用; 连接释放后地址被新连接复用时沿用旧号
+ */
+static uint32_t capConnID(MqttCapture *cap, const void *conn)
+{
+    CapConn *table, *old;
+    uint32_t size, i, j;
+
+    // 负载超过一半时扩容
+    if(cap->connCount * 2 >= cap->connSize)
+    {
+        size = cap->connSize ? cap->connSize * 2 : CAP_CONN_MIN;
+        table = calloc(size, sizeof(CapConn));
+        if(!table)
+            return 0;
+        old = cap->conns;
+        for(i = 0; i < cap->connSize; i++)
+        {
+            if(!old[i].id)
+                continue;
+            for(j = ((uintptr_t)old[i].conn >> 4) & (size - 1); table[j].id; j = (j + 1) & (size - 1));
+            table[j] = old[i];
+        }
+        free(old);
+        cap->conns = table;
+        cap->connSize = size;
+    }
+    for(i = ((uintptr_t)conn >> 4) & (cap->connSize - 1); cap->conns[i].id; i = (i + 1) & (cap->connSize - 1))
+    {
+        if(cap->conns[i].conn == conn)
+            return cap->conns[i].id;
+    }
+    cap->conns[i].conn = conn;
+    cap->conns[i].id = ++cap->connCount;
+    return cap->conns[i].id;
+}
+
+/**
+ * @brief   把已提交的记录写入文件
+ * @return  写入的记录数
+ */
+static uint32_t capDrain(MqttCapture *cap)
+{
+    uint64_t tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+    uint32_t count = 0, ready, need, id;
+    CapHead *h;
+    uint8_t *p;
+
+    for(;;)
+    {
+        h = (CapHead*)(cap->ring + (tail & (cap->size - 1)));
+        // 按顺序提交: 前面的记录还在写时, 后面已提交的记录也要等待
+        ready = atomic_load_explicit(&h->ready, memory_order_acquire);
+        if(!ready)
+            break;
+        if(cap->scratchSize < h->len)
+        {
+            p = realloc(cap->scratch, h->len);
+            if(!p)
+                break;
+            cap->scratch = p;
+            cap->scratchSize = h->len;
+        }
+        id = capConnID(cap, h->conn);
+        if(!id)
+            break;
+        ringRead(cap, tail + CAP_ALIGN, cap->scratch, h->len);
+        // 多个线程并发抓包时后提交的记录时间可能略早, 时间差截为 0, 文件中的时间保持单调
+        writeVarint(cap->file, h->time > cap->last ? h->time - cap->last : 0);
+        writeVarint(cap->file, id);
+        fputc(ready >> 1, cap->file);
+        writeVarint(cap->file, h->len);
+        fwrite(cap->scratch, 1, h->len, cap->file);
+        if(h->time > cap->last)
+            cap->last = h->time;
+        // 清零整段空间, 旧数据在下一圈不会被误认为已提交的记录头
+        need = capSpan(h->len);
+        if((tail & (cap->size - 1)) + need <= cap->size)
+            memset(h, 0, need);
+        else
+        {
+            memset(h, 0, cap->size - (tail & (cap->size - 1)));
+            memset(cap->ring, 0, need - (cap->size - (tail & (cap->size - 1))));
+        }
+        tail += need;
+        atomic_store_explicit(&cap->tail, tail, memory_order_release);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief   写线程, 不占用收发线程的时间
+ * @param   param [in] 抓包对象
+ */
+static void *capWriter(void *param)
+{
+    MqttCapture *cap = param;
+
+    for(;;)
+    {
+        if(capDrain(cap))
+            continue;
+        // 先检查退出标志再确认缓冲区为空, 退出前不会漏掉最后的记录
+        if(!atomic_load_explicit(&cap->run, memory_order_acquire) && !capDrain(cap))
+            break;
+        fflush(cap->file);
+        Sleep(MQTT_CAP_IDLE);
+    }
+    fflush(cap->file);
+    return NULL;
+}
+
+MqttCapture *mqttCaptureOpen(const char *path, uint32_t ringSize)
+{
+    MqttCapture *cap;
+
+    if(!ringSize)
+        ringSize = MQTT_CAP_RING;
+    if((ringSize & (ringSize - 1)) || ringSize < CAP_ALIGN * 2)
+        return NULL;
+    cap = calloc(1, sizeof(MqttCapture));
+    if(!cap)
+        return NULL;
+    cap->ring = calloc(1, ringSize);
+    cap->file = fopen(path, "wb");
+    if(!cap->ring || !cap->file)
+        goto fail;
+    cap->size = ringSize;
+    fwrite(CAP_MAGIC, 1, 4, cap->file);
+    fputc(CAP_VERSION, cap->file);
+    cap->last = mqttTimeUs();
+    atomic_init(&cap->head, 0);
+    atomic_init(&cap->tail, 0);
+    atomic_init(&cap->dropped, 0);
+    atomic_init(&cap->run, 1);
+    if(pthread_create(&cap->thread, NULL, capWriter, cap))
+        goto fail;
+    return cap;
+
+fail:
+    if(cap->file)
+        fclose(cap->file);
+    free(cap->ring);
+    free(cap);
+    return NULL;
+}
+
+void mqttCaptureClose(MqttCapture *cap)
+{
+    atomic_store_explicit(&cap->run, 0, memory_order_release);
+    pthread_join(cap->thread, NULL);
+    fclose(cap->file);
+    free(cap->conns);
+    free(cap->scratch);
+    free(cap->ring);
+    free(cap);
+}
+
+uint32_t mqttCaptureDropped(MqttCapture *cap)
+{
+    return atomic_load_explicit(&cap->dropped, memory_order_relaxed);
+}
+
+/**
+ * @brief   读取变长整数
+ * @return  读取后的位置, 格式错误返回 0
+ */
+static uint32_t readVarint(const uint8_t *buf, uint32_t pos, uint32_t len, uint64_t *v)
+{
+    uint32_t shift;
+
+    for(*v = 0, shift = 0; pos < len && shift < 64; shift += 7)
+    {
+        *v |= (uint64_t)(buf[pos] & 0x7F) << shift;
+        if(!(buf[pos++] & 0x80))
+            return pos;
+    }
+    return 0;
+}
+
+MqttReplay *mqttReplayLoad(const char *path, uint32_t conn)
+{
+    MqttReplay *replay = NULL;
+    FILE *file;
+    uint8_t *buf = NULL;
+    uint32_t pos, count, total;
+    uint64_t delta, len, time, id;
+    long size;
+    uint8_t dir;
+    int pass;
+
+    file = fopen(path, "rb");
+    if(!file)
+        return NULL;
+    if(fseek(file, 0, SEEK_END) || (size = ftell(file)) < 5 || size > 0x7FFFFFFF || fseek(file, 0, SEEK_SET))
+        goto fail;
+    buf = malloc(size);
+    if(!buf || fread(buf, 1, size, file) != (size_t)size)
+        goto fail;
+    if(memcmp(buf, CAP_MAGIC, 4) || buf[4] != CAP_VERSION)
+        goto fail;
+    replay = calloc(1, sizeof(MqttReplay));
+    if(!replay)
+        goto fail;
+    // 第一遍统计收到的报文数和总长度, 第二遍复制
+    for(pass = 0; pass < 2; pass++)
+    {
+        for(pos = 5, count = total = 0, time = 0; pos < (uint32_t)size; pos += len)
+        {
+            if(!(pos = readVarint(buf, pos, size, &delta)) || pos >= (uint32_t)size \
+               || !(pos = readVarint(buf, pos, size, &id)) || pos >= (uint32_t)size)
+                goto fail;
+            dir = buf[pos++];
+            if(!(pos = readVarint(buf, pos, size, &len)) || len > (uint64_t)(size - pos))
+                goto fail;
+            time += delta;
+            // 未指定连接号时, 出现第二个连接说明是共用的抓包, 无法区分字节流
+            if(!conn && id != 1)
+                goto fail;
+            if(MQTT_CAP_IN != dir || !len || id != (conn ? conn : 1))
+                continue;
+            if(pass)
+            {
+                memcpy(replay->data + total, buf + pos, len);
+                replay->ends[count] = total + len;
+                replay->times[count] = time;
+            }
+            total += len;
+            count++;
+        }
+        if(!pass)
+        {
+            replay->data = malloc(total ? total : 1);
+            replay->ends = malloc(sizeof(uint32_t) * (count ? count : 1));
+            replay->times = malloc(sizeof(uint64_t) * (count ? count : 1));
+            if(!replay->data || !replay->ends || !replay->times)
+                goto fail;
+        }
+    }
+    replay->count = count;
+    free(buf);
+    fclose(file);
+    return replay;
+
+fail:
+    if(replay)
+        mqttReplayFree(replay);
+    free(buf);
+    fclose(file);
+    return NULL;
+}
+
+/**
+ * @brief   回放传输层: 发送的数据直接丢弃
+ */
+static int32_t replaySend(void *conn, const void *data, unsigned int len)
+{
+    (void)conn;
+    (void)data;
+    return len;
+}
+
+/**
+ * @brief   回放传输层: 按记录顺序返回收到的字节流, 全部读完后返回 0 (连接关闭)
+ */
+static int32_t replayRecv(void *conn, void *data, unsigned int len)
+{
+    MqttReplay *replay = conn;
+    uint32_t begin;
+    uint64_t due, now;
+
+    if(replay->rec >= replay->count)
+        return 0;
+    begin = replay->rec ? replay->ends[replay->rec - 1] : 0;
+    // 每条记录开始时等到抓包时的相对时间
+    if(replay->paced && replay->pos == begin)
+    {
+        due = replay->start + (replay->times[replay->rec] - replay->times[0]);
+        while((now = mqttTimeUs()) < due)
+            Sleep((due - now) / 1000);
+    }
+    if(len > replay->ends[replay->rec] - replay->pos)
+        len = replay->ends[replay->rec] - replay->pos;
+    memcpy(data, replay->data + replay->pos, len);
+    replay->pos += len;
+    if(replay->pos == replay->ends[replay->rec])
+        replay->rec++;
+    return len;
+}
+
+static const MqttTransport replayTransport = {
+    replaySend,
+    replayRecv,
+    NULL
+};
+
+int mqttReplayRun(MqttReplay *replay, MqttBroker *broker, uint8_t paced)
+{
+    const MqttTransport *transport = broker->transport;
+    void *conn = broker->conn;
+    int ret, count = 0;
+
+    replay->rec = 0;
+    replay->pos = 0;
+    replay->paced = paced;
+    replay->start = mqttTimeUs();
+    broker->transport = &replayTransport;
+    broker->conn = replay;
+    while((ret = mqttThread(broker)) > 0)
+        count++;
+    broker->transport = transport;
+    broker->conn = conn;
+    return ret < 0 ? ret : count;
+}
+
+void mqttReplayFree(MqttReplay *replay)
+{
+    free(replay->data);
+    free(replay->ends);
+    free(replay->times);
+    free(replay);
+}
@@ -0,0 +1,81 @@
+#ifndef __LIBMQTTCAP_H
+#define __LIBMQTTCAP_H
+
+#include "libmqtt.h"
+
+// 默认环形缓冲区大小 (字节), 必须是 2 的幂
+#define MQTT_CAP_RING          (1 << 20)
+// 写线程在缓冲区为空时的等待时间 (ms)
+#define MQTT_CAP_IDLE          1
+// 记录方向
+#define MQTT_CAP_IN            0
+#define MQTT_CAP_OUT           1
+
+/**
+ * 抓包文件格式 (见 libmqttcap.c):
+ *     "MQCP" 版本(1 字节)
+ *     记录: [与上一条记录的时间差 us, 变长整数][连接号, 变长整数][方向 1 字节][长度, 变长整数][MQTT 字节流]
+ * 变长整数与 MQTT 剩余长度字段的编码相同, 每字节 7 位, 低位在前
+ * 连接号按 broker 在抓包中第一次出现的顺序从 1 开始编号, 多个 broker 共用一个抓包对象时用来区分各自的字节流
+ */
+typedef struct MqttCapture MqttCapture;
+typedef struct MqttReplay MqttReplay;
+
+/**
+ * @brief   打开抓包文件并启动写线程
+ * @param   path [in] 文件路径, 已存在时覆盖
+ * @param   ringSize [in] 环形缓冲区大小, 0 = MQTT_CAP_RING, 必须是 2 的幂
+ * @return  抓包对象, 失败返回 NULL
+ * @note    令 broker->capture 指向返回值即开始抓包, 多个 broker 可以共用一个抓包对象
+ */
+extern MqttCapture *mqttCaptureOpen(const char *path, uint32_t ringSize);
+
+/**
+ * @brief   写完缓冲区中剩余的记录, 停止写线程并关闭文件
+ * @param   cap [in] 抓包对象
+ * @warning 调用前先将 broker->capture 置为 NULL, 并确保没有线程还在收发
+ */
+extern void mqttCaptureClose(MqttCapture *cap);
+
+/**
+ * @brief   追加一条记录 (线程安全, 无锁), 由 libmqtt.c 在收发时调用
+ * @param   cap [in] 抓包对象
+ * @param   conn [in] 所属连接 (broker 指针), 只用来区分连接, 不会被访问
+ * @param   dir [in] MQTT_CAP_IN 或 MQTT_CAP_OUT
+ * @param   data [in] 数据
+ * @param   len [in] 数据长度
+ * @note    缓冲区满时丢弃该记录并计数, 不会阻塞收发线程
+ */
+extern void mqttCapture(MqttCapture *cap, const void *conn, uint8_t dir, const void *data, uint32_t len);
+
+/**
+ * @brief   缓冲区满而丢弃的记录数, 不为 0 时抓包文件不完整, 回放结果不可信
+ */
+extern uint32_t mqttCaptureDropped(MqttCapture *cap);
+
+/**
+ * @brief   将抓包文件读入内存, 只保留指定连接收到的报文
+ * @param   path [in] 文件路径
+ * @param   conn [in] 连接号, 0 = 文件中只有一个连接 (多个连接共用的抓包返回 NULL)
+ * @return  回放对象, 文件不存在, 格式错误, 连接号不符或内存不足返回 NULL
+ * @note    不同连接的字节流混在一起会被当作一个连接解析, 所以共用的抓包必须指定连接号
+ */
+extern MqttReplay *mqttReplayLoad(const char *path, uint32_t conn);
+
+/**
+ * @brief   把收到的报文重新送入 mqttThread 解析和分发, 可以重复调用
+ * @param   replay [in] 回放对象
+ * @param   broker [in] broker 指针, recvCB/v5/codec 等按抓包时的配置设置
+ * @param   paced [in] 0 = 尽快回放, 1 = 按抓包时的时间间隔回放
+ * @return  >= 0 处理的报文数, < 0 同 mqttThread 的错误返回值
+ * @note    回放期间 broker->transport 被临时替换, 发出的应答被丢弃;
+ *          抓包从 mqttConnect 之前开始时, CONNACK 协商的状态 (如 5.0 别名上限) 才能完整重现
+ */
+extern int mqttReplayRun(MqttReplay *replay, MqttBroker *broker, uint8_t paced);
+
+/**
+ * @brief   释放回放对象
+ */
+extern void mqttReplayFree(MqttReplay *replay);
+
+#endif // __LIBMQTTCAP_H
@@ -0,0 +1,310 @@
+#include <string.h>
+#include <stdlib.h>
+#include "libmqtt.h"
+
+#define LZ4_MINMATCH      4
+#define LZ4_LASTLITERALS  5   // 最后 5 字节必须是字面量
+#define LZ4_MFLIMIT       12  // 距离结尾 12 字节以内不再开始匹配
+#define LZ4_MAX_OFFSET    65535
+
+/**
+ * @brief   读取 4 字节 (不要求对齐)
+ */
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/**
+ * @brief   写入 LZ4 长度扩展字节
+ * @return  写入后的位置, 空间不足返回 0
+ */
+static uint32_t lz4Len(uint8_t *out, uint32_t op, uint32_t cap, uint32_t len)
+{
+    for(; len >= 255; len -= 255)
+    {
+        if(op >= cap)
+            return 0;
+        out[op++] = 255;
+    }
+    if(op >= cap)
+        return 0;
+    out[op++] = len;
+    return op;
+}
+
+/**
+ * @brief   写入一个 LZ4 序列: [token][字面量长度][字面量][偏移][匹配长度]
+ * @param   match [in] 匹配长度, 0 = 最后一个序列 (只有字面量)
+ * @return  写入后的位置, 空间不足返回 0
+ */
+static uint32_t lz4Sequence(uint8_t *out, uint32_t op, uint32_t cap, const uint8_t *lit, uint32_t litLen, \
+                            uint32_t offset, uint32_t match)
+{
+    uint8_t *token;
+
+    if(op >= cap)
+        return 0;
+    token = out + op++;
+    *token = (litLen >= 15 ? 15 : litLen) << 4;
+    if(litLen >= 15 && !(op = lz4Len(out, op, cap, litLen - 15)))
+        return 0;
+    if(op + litLen > cap)
+        return 0;
+    memcpy(out + op, lit, litLen);
+    op += litLen;
+    if(!match)
+        return op;
+    if(op + 2 > cap)
+        return 0;
+    out[op++] = offset & 0xFF;
+    out[op++] = offset >> 8;
+    match -= LZ4_MINMATCH;
+    *token |= (match >= 15) ? 15 : match;
+    if(match >= 15 && !(op = lz4Len(out, op, cap, match - 15)))
+        return 0;
+    return op;
+}
+
+int32_t mqttLz4Encode(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap)
+{
+    uint32_t *table = ((MqttLz4*)ctx)->table;
+    uint32_t ip = 0, anchor = 0, op = 0, cand, match, miss = 0, h, seq;
+
+    if(len < LZ4_MFLIMIT + 1)
+        return 0;
+    // 哈希表不清零: 旧位置都要经过 cand < ip 和内容比较, 不会产生错误匹配
+    while(ip < len - LZ4_MFLIMIT)
+    {
+        seq = read32(in + ip);
+        h = (seq * 2654435761u) >> (32 - MQTT_LZ4_HASH_LOG);
+        cand = table[h];
+        table[h] = ip;
+        if(cand >= ip || ip - cand > LZ4_MAX_OFFSET || read32(in + cand) != seq)
+        {
+            ip += 1 + (miss++ >> 6); // 连续找不到匹配时加大步长, 快速跳过不可压缩的数据
+            continue;
+        }
+        miss = 0;
+        for(match = LZ4_MINMATCH; ip + match < len - LZ4_LASTLITERALS && in[cand + match] == in[ip + match]; match++);
+        if(!(op = lz4Sequence(out, op, cap, in + anchor, ip - anchor, ip - cand, match)))
+            return 0;
+        ip += match;
+        anchor = ip;
+    }
+    if(!(op = lz4Sequence(out, op, cap, in + anchor, len - anchor, 0, 0)))
+        return 0;
+    return op;
+}
+
+int32_t mqttLz4Decode(void *ctx, const uint8_t *in, uint32_t len, uint8_t *out, uint32_t cap)
+{
+    uint32_t ip = 0, op = 0, lit, match, offset;
+    uint8_t token, b;
+
+    (void)ctx;
+    while(ip < len)
+    {
+        token = in[ip++];
+        lit = token >> 4;
+        if(15 == lit)
+        {
+            do {
+                if(ip >= len)
+                    return -1;
+                b = in[ip++];
+                lit += b;
+            } while(255 == b);
+        }
+        if(lit > len - ip || lit > cap - op)
+            return -1;
+        memcpy(out + op, in + ip, lit);
+        ip += lit;
+        op += lit;
+        if(ip >= len)
+            break; // 最后一个序列没有匹配部分
+        if(len - ip < 2)
+            return -1;
+        offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        if(!offset || offset > op)
+            return -1;
+        match = token & 0x0F;
+        if(15 == match)
+        {
+            do {
+                if(ip >= len)
+                    return -1;
+                b = in[ip++];
+                match += b;
+            } while(255 == b);
+        }
+        match += LZ4_MINMATCH;
+        if(match > cap - op)
+            return -1;
+        // 匹配区可能与输出重叠, 逐字节复制
+        for(; match; match--, op++)
+            out[op] = out[op - offset];
+    }
+    return op;
+}
+
+/**
+ * @brief   确保缓冲区足够大, 超过 MQTT_CODEC_KEEP 的缓冲区连续 MQTT_CODEC_SHRINK 次只需要小缓冲区时收缩
+ * @param   small [in/out] 连续只需要小缓冲区的次数
+ * @return  0 成功, -1 内存不足
+ */
+static int scratchReserve(uint8_t **buf, uint32_t *size, uint8_t *small, uint32_t need)
+{
+    uint8_t *p;
+
+    if(need > MQTT_CODEC_KEEP)
+        *small = 0;
+    if(*size >= need)
+    {
+        // 偶尔出现的大负载不让缓冲区一直占着内存; 大小负载交替出现时不反复 realloc
+        if(*size > MQTT_CODEC_KEEP && need <= MQTT_CODEC_KEEP && ++*small >= MQTT_CODEC_SHRINK \
+           && (p = realloc(*buf, MQTT_CODEC_KEEP)))
+        {
+            *buf = p;
+            *size = MQTT_CODEC_KEEP;
+            *small = 0;
+        }
+        return 0;
+    }
+    p = realloc(*buf, need);
+    if(!p)
+        return -1;
+    *buf = p;
+    *size = need;
+    return 0;
+}
+
+/**
+ * @brief   按编解码器链编码负载
+ * @param   chain [in] 编解码状态
+ * @param   msg [in] 原始负载
+ * @param   len [in] 原始负载长度
+ * @param   head [out] 编解码头, 至少 MQTT_CODEC_HEAD 字节
+ * @param   headLen [out] 编解码头长度
+ * @param   body [out] 编码后的负载, 指向 msg 或 chain 的发送缓冲区
+ * @return  编码后的负载长度
+ */
+uint32_t mqttCodecEncode(MqttCodecChain *chain, const uint8_t *msg, uint32_t len, \
+                         uint8_t *head, uint32_t *headLen, const uint8_t **body)
+{
+    MqttCodec *codec;
+    uint8_t ids[MQTT_CODEC_STAGES];
+    uint32_t lens[MQTT_CODEC_STAGES];
+    uint32_t stages = 0, cur = 0, i, n;
+    int32_t ret;
+
+    *body = msg;
+    // 原长度最多占 4 字节 (小于 2^28), 与 mqttCodecDecode 和 MQTT_CODEC_HEAD 一致; MQTT 负载本来就不会更长
+    for(codec = chain->codec; codec && stages < MQTT_CODEC_STAGES && len >= chain->threshold && len > 1 \
+        && len < (1u << 28); codec = codec->next)
+    {
+        // 在两个发送缓冲区之间交替, 输出必须比输入短才采用
+        if(scratchReserve(&chain->txBuf[cur], &chain->txSize[cur], &chain->txSmall[cur], len))
+            break;
+        ret = codec->encode(codec->ctx, *body, len, chain->txBuf[cur], len - 1);
+        if(ret <= 0)
+            continue;
+        ids[stages] = codec->id;
+        lens[stages++] = len;
+        *body = chain->txBuf[cur];
+        len = ret;
+        cur ^= 1;
+    }
+    // 编解码头: 最后一级在前, 解码时按顺序处理
+    for(n = 0; stages; stages--)
+    {
+        head[n++] = ids[stages - 1];
+        for(i = lens[stages - 1]; i >= 0x80; i >>= 7)
+            head[n++] = (i & 0x7F) | 0x80;
+        head[n++] = i;
+    }
+    head[n++] = 0;
+    *headLen = n;
+    return len;
+}
+
+/**
+ * @brief   按编解码头解码负载
+ * @param   chain [in] 编解码状态
+ * @param   in [in] 带编解码头的负载
+ * @param   len [in] 负载长度
+ * @param   prefix [in] 解码结果之前需要预留的字节数
+ * @param   out [out] 解码结果, 未编码时指向 in 中的原始负载
+ * @return  解码后的负载长度, < 0 格式错误, 不认识的编解码器, 超过 maxLen 或内存不足
+ */
+int32_t mqttCodecDecode(MqttCodecChain *chain, const uint8_t *in, uint32_t len, uint32_t prefix, uint8_t **out)
+{
+    MqttCodec *codec;
+    uint8_t ids[MQTT_CODEC_STAGES];
+    uint32_t lens[MQTT_CODEC_STAGES];
+    uint32_t stages = 0, pos = 0, i, cur = 0, shift;
+    uint32_t maxLen = chain->maxLen ? chain->maxLen : MQTT_CODEC_MAX_LEN;
+    const uint8_t *src;
+    int32_t ret;
+
+    // 解析编解码头
+    for(;;)
+    {
+        if(pos >= len)
+            return -1;
+        if(!in[pos])
+            break;
+        if(stages >= MQTT_CODEC_STAGES)
+            return -1;
+        ids[stages] = in[pos++];
+        for(lens[stages] = 0, shift = 0; ; shift += 7)
+        {
+            if(pos >= len || shift > 21)
+                return -1; // 最多 4 字节, 与 mqttCodecEncode 一致
+            lens[stages] |= (uint32_t)(in[pos] & 0x7F) << shift;
+            if(!(in[pos++] & 0x80))
+                break;
+        }
+        // 原长度由对端声明, 必须先检查再分配缓冲区
+        if(lens[stages] > maxLen)
+            return -1;
+        stages++;
+    }
+    pos++;
+    src = in + pos;
+    len -= pos;
+    *out = (uint8_t*)src;
+    for(i = 0; i < stages; i++)
+    {
+        for(codec = chain->codec; codec && codec->id != ids[i]; codec = codec->next);
+        if(!codec)
+            return -1;
+        if(scratchReserve(&chain->rxBuf[cur], &chain->rxSize[cur], &chain->rxSmall[cur], prefix + lens[i]))
+            return -1;
+        ret = codec->decode(codec->ctx, src, len, chain->rxBuf[cur] + prefix, lens[i]);
+        if(ret < 0 || (uint32_t)ret != lens[i])
+            return -1;
+        src = *out = chain->rxBuf[cur] + prefix;
+        len = ret;
+        cur ^= 1;
+    }
+    return len;
+}
+
+void mqttCodecFree(MqttCodecChain *chain)
+{
+    int i;
+
+    for(i = 0; i < 2; i++)
+    {
+        free(chain->txBuf[i]);
+        free(chain->rxBuf[i]);
+        chain->txBuf[i] = chain->rxBuf[i] = NULL;
+        chain->txSize[i] = chain->rxSize[i] = 0;
+        chain->txSmall[i] = chain->rxSmall[i] = 0;
+    }
+}
@@ -0,0 +1,750 @@
+#include <stdlib.h>
+#include <string.h>
+#include "libmqttengine.h"
+// 必须在包含 winsock 之前定义, 否则 select 最多只能管理 64 个 socket
+#define FD_SETSIZE MQTT_ENGINE_CONN_MAX
+#include <windows.h>
+#include <winsock.h>
+#include <pthread.h>
+
+// 超时检查的时间间隔 (ms)
+#define ENGINE_SWEEP  100
+// 等待应答的超时时间 (us), 与阻塞发布重传全部次数的时间相同
+#define ENGINE_ACK_TIMEOUT  (MQTT_TIMEOUE * MQTT_RETRY * 1000ull)
+// 每个连接排队等待发送的应答数; 一轮最多读 MQTT_ENGINE_BURST 个报文, 每个报文最多产生一个应答
+#define ENGINE_ACK_QUEUE  (MQTT_ENGINE_BURST * 2)
+// 一个应答报文的长度: [类型][剩余长度 2][消息 ID 2 字节]
+#define ENGINE_ACK_LEN    4
+// EngineConn.ready 的标志
+#define ENGINE_READ   1
+#define ENGINE_WRITE  2
+
+extern int mqttSetNonblock(void *socket, uint8_t nonblock);
+extern uint64_t mqttTimeUs(void);
+extern int mqttTryLock(void *lock);
+extern void mqttUnlock(void *lock);
+extern int32_t mqttSendAcks(MqttBroker *broker, const uint8_t *data, unsigned int len);
+
+typedef struct
+{
+    MqttJob job;
+    MqttBroker *broker;
+    void *param;
+} MqttEngineJob;
+
+// 等待应答的发布
+typedef struct
+{
+    uint8_t type;            // 等待的应答 PUBACK/PUBREC/PUBCOMP, 0 = 空闲
+    uint16_t msgID;
+    uint64_t deadline;
+    MqttDoneCB done;
+    void *param;
+} EnginePending;
+
+// 要调用的完成回调, 先在锁内收集, 出锁后再调用
+typedef struct
+{
+    MqttDoneCB done;
+    void *param;
+    MqttRet ret;
+} EngineDone;
+
+// 引擎中的一个连接, 关闭后放回分片的空闲链表复用, 引擎销毁时才释放
+typedef struct EngineConn
+{
+    MqttBroker *broker;
+    struct MqttShard *shard;
+    struct EngineConn *next;  // 空闲链表
+    uint32_t gen;             // 每次加入引擎时加 1, 用于发现连接已被关闭并复用
+    uint8_t more;             // 1 = 上次没有读完 (达到 MQTT_ENGINE_BURST 或传输层还有缓冲的数据), 不等 socket 可读
+    uint8_t ready;            // ENGINE_READ/ENGINE_WRITE = 本轮 select 报告可读/可写, 只在 I/O 线程中访问
+    uint8_t ackRetry;         // 1 = 上次发送应答时其它线程正在发送, 下一轮不等可写直接重试
+    // 等待 socket 可写后发送的应答报文, 只在 I/O 线程中访问
+    uint8_t acks[ENGINE_ACK_QUEUE * ENGINE_ACK_LEN];
+    unsigned int ackLen;
+    // 加入引擎前的 broker->ackCB, 引擎处理完应答后转调
+    void (*ackCB)(MqttBroker *broker, uint8_t type, uint16_t msgID, uint8_t reason);
+    // 以下在分片 ackLock 内访问
+    EnginePending pending[MQTT_ENGINE_INFLIGHT];
+    unsigned int pendingCount;
+} EngineConn;
+
+// select 等待的 socket 与连接的对应关系, 按 socket 排序, 用于把 select 的结果映射回连接
+typedef struct
+{
+    SOCKET socket;
+    EngineConn *conn;
+    uint32_t gen;             // 加入 select 时连接的 gen, 等待期间连接被移出又复用时不再匹配
+} EngineSock;
+
+typedef struct MqttShard
+{
+    MqttEngine *engine;
+    unsigned int cpu;
+    volatile int run;
+    pthread_t ioThread;
+    pthread_t jobThread;
+    // 连接表, 只有 I/O 线程和 add/remove 会访问
+    CRITICAL_SECTION connLock;
+    EngineConn *conns[MQTT_ENGINE_CONN_MAX];
+    unsigned int connCount;
+    EngineConn *freeConns;
+    // 本轮 select 的 socket 表, 只在 I/O 线程中访问
+    EngineSock socks[MQTT_ENGINE_CONN_MAX];
+    unsigned int sockCount;
+    // 任务队列, 环形缓冲区
+    CRITICAL_SECTION jobLock;
+    CONDITION_VARIABLE jobCond;
+    MqttEngineJob jobs[MQTT_ENGINE_JOB_MAX];
+    unsigned int jobHead, jobTail;
+    // 保护 broker->engine 和各连接的 pending, 只在本分片的两个线程之间竞争; 与 connLock 同时持有时后进入
+    CRITICAL_SECTION ackLock;
+} MqttShard;
+
+struct MqttEngine
+{
+    unsigned int count;
+    MqttCloseCB closeCB;
+    MqttShard *shards[MQTT_ENGINE_SHARD_MAX]; // 每个分片单独分配, 避免不同核心的数据落在同一缓存行
+};
+
+/**
+ * @brief   计算 broker 所在的分片 (FNV-1a 哈希 clientid)
+ * @param   engine [in] 引擎指针
+ * @param   broker [in] broker 指针
+ * @return  分片指针
+ */
+static MqttShard *shardOf(MqttEngine *engine, const MqttBroker *broker)
+{
+    const uint8_t *p = (const uint8_t*)broker->clientid;
+    uint32_t hash = 2166136261u;
+
+    while(*p)
+    {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return engine->shards[hash % engine->count];
+}
+
+/**
+ * @brief   将当前线程绑定到指定的 CPU 核心
+ * @param   cpu [in] 核心序号
+ */
+static void bindCpu(unsigned int cpu)
+{
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (cpu % (sizeof(DWORD_PTR) * 8)));
+}
+
+/**
+ * @brief   按消息 ID 查找等待应答的发布
+ * @return  NULL = 没有
+ */
+static EnginePending *pendingFind(EngineConn *conn, uint16_t msgID)
+{
+    unsigned int i;
+
+    for(i = 0; i < MQTT_ENGINE_INFLIGHT; i++)
+    {
+        if(conn->pending[i].type && conn->pending[i].msgID == msgID)
+            return &conn->pending[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief   结束一个等待应答的发布, 回调记录到 done 中, 出锁后由 engineCall 调用
+ * @param   conn [in] 连接
+ * @param   pending [in] 要结束的发布
+ * @param   ret [in] 发布结果
+ * @param   done [out] 要调用的回调
+ * @note    在 ackLock 内调用
+ */
+static void pendingDone(EngineConn *conn, EnginePending *pending, MqttRet ret, EngineDone *done)
+{
+    done->done = pending->done;
+    done->param = pending->param;
+    done->ret = ret;
+    pending->type = 0;
+    conn->pendingCount--;
+}
+
+/**
+ * @brief   调用收集到的完成回调
+ */
+static void engineCall(MqttBroker *broker, const EngineDone *done, unsigned int count)
+{
+    unsigned int i;
+
+    for(i = 0; i < count; i++)
+    {
+        if(done[i].done)
+            done[i].done(broker, done[i].ret, done[i].param);
+    }
+}
+
+/**
+ * @brief   替换 broker->ackSend, 在 I/O 线程中把 mqttThread 的应答放入队列, socket 可写时由 engineFlush 发送
+ * @note    不直接发送: 发送缓冲区满或其它线程持有 sendLock 时会阻塞整个分片
+ */
+static int engineAckSend(MqttBroker *broker, uint8_t type, uint16_t msgID)
+{
+    EngineConn *conn = broker->engine; // I/O 线程持有 connLock, 连接不会在此期间移出
+    uint8_t *ack = conn->acks + conn->ackLen;
+
+    if(conn->ackLen >= sizeof(conn->acks))
+        return MQTT_MEM_ERR; // 读取前已留出一轮的空间, 不会发生
+    // 与 mqttPubRetuen 的报文相同
+    ack[0] = type;
+    ack[1] = 0x02;
+    ack[2] = msgID >> 8;
+    ack[3] = msgID & 0xFF;
+    conn->ackLen += ENGINE_ACK_LEN;
+    return MQTT_OK;
+}
+
+/**
+ * @brief   socket 可写时一次发送排队的应答, 发不完的留到下一次可写
+ * @param   conn [in] 连接
+ * @note    拿不到 sendLock (其它线程正在发送) 时下一轮再试, 不阻塞 I/O 线程;
+ *          发送失败时连接随后会在读取时关闭, 剩下的应答丢弃
+ */
+static void engineFlush(EngineConn *conn)
+{
+    MqttBroker *broker = conn->broker;
+    int32_t ret;
+
+    conn->ackRetry = !mqttTryLock(broker->sendLock);
+    if(conn->ackRetry)
+        return;
+    ret = mqttSendAcks(broker, conn->acks, conn->ackLen);
+    mqttUnlock(broker->sendLock);
+    if(ret < 0)
+        conn->ackLen = 0;
+    else if(ret > 0)
+    {
+        conn->ackLen -= ret;
+        memmove(conn->acks, conn->acks + ret, conn->ackLen);
+    }
+}
+
+/**
+ * @brief   替换 broker->ackCB 的应答处理, 在分片 I/O 线程的 mqttThread 中调用
+ *          结束对应的发布, QoS 2 收到 PUBREC 后发送 PUBREL, 最后转调用户的 ackCB
+ */
+static void engineAck(MqttBroker *broker, uint8_t type, uint16_t msgID, uint8_t reason)
+{
+    EngineConn *conn = broker->engine; // I/O 线程持有 connLock, 连接不会在此期间移出
+    EnginePending *pending;
+    EngineDone done = {NULL, NULL, MQTT_OK};
+    int release = 0;
+
+    EnterCriticalSection(&conn->shard->ackLock);
+    pending = pendingFind(conn, msgID);
+    if(pending && pending->type == type)
+    {
+        if(MQTT_MSG_PUBREC == type && reason < 0x80)
+        {
+            // QoS 2 第二步, 发送 PUBREL 后等待 PUBCOMP
+            pending->type = MQTT_MSG_PUBCOMP;
+            pending->deadline = mqttTimeUs() + ENGINE_ACK_TIMEOUT;
+            release = 1;
+        }
+        else
+            pendingDone(conn, pending, (reason >= 0x80) ? MQTT_REASON_ERR : MQTT_OK, &done);
+    }
+    LeaveCriticalSection(&conn->shard->ackLock);
+    // 和其它应答一样排队发送; 发送失败时连接随后会关闭, 或者超时结束
+    if(release)
+        engineAckSend(broker, MQTT_MSG_PUBREL | 0x02, msgID); // PUBREL 固定头标志位必须为 0010
+    engineCall(broker, &done, 1);
+    if(conn->ackCB)
+        conn->ackCB(broker, type, msgID, reason);
+}
+
+/**
+ * @brief   结束超时的发布
+ * @param   shard [in] 分片指针
+ * @param   conn [in] 连接
+ * @param   now [in] 当前时间 (us)
+ */
+static void engineSweep(MqttShard *shard, EngineConn *conn, uint64_t now)
+{
+    EngineDone done[MQTT_ENGINE_INFLIGHT];
+    unsigned int i, count = 0;
+
+    EnterCriticalSection(&shard->ackLock);
+    for(i = 0; i < MQTT_ENGINE_INFLIGHT; i++)
+    {
+        if(conn->pending[i].type && conn->pending[i].deadline <= now)
+            pendingDone(conn, &conn->pending[i], MQTT_ACK_ERR, &done[count++]);
+    }
+    LeaveCriticalSection(&shard->ackLock);
+    engineCall(conn->broker, done, count);
+}
+
+/**
+ * @brief   将连接移出分片, 恢复 broker 的成员, 未完成的发布以 MQTT_SEND_ERR 结束
+ * @param   shard [in] 分片指针
+ * @param   index [in] 连接在连接表中的位置, 由末尾的连接补位
+ * @param   done [out] 要调用的回调, 由调用者在 engineCall 中调用
+ * @return  回调数
+ * @note    在 connLock 内调用
+ */
+static unsigned int engineDetach(MqttShard *shard, unsigned int index, EngineDone *done)
+{
+    EngineConn *conn = shard->conns[index];
+    MqttBroker *broker = conn->broker;
+    unsigned int i, count = 0;
+
+    EnterCriticalSection(&shard->ackLock);
+    for(i = 0; i < MQTT_ENGINE_INFLIGHT; i++)
+    {
+        if(conn->pending[i].type)
+            pendingDone(conn, &conn->pending[i], MQTT_SEND_ERR, &done[count++]);
+    }
+    broker->engine = NULL;
+    broker->ackCB = conn->ackCB;
+    broker->ackSend = NULL;
+    broker->nonblock = 0;
+    LeaveCriticalSection(&shard->ackLock);
+    conn->ackLen = 0; // 连接已关闭或不再由引擎读取, 没发出去的应答丢弃
+    shard->conns[index] = shard->conns[--shard->connCount];
+    conn->next = shard->freeConns;
+    shard->freeConns = conn;
+    return count;
+}
+
+/**
+ * @brief   是否读取该连接, 已停止读取 (见 MqttFlow) 的连接不读取, 等 mqttFlowRelease 恢复;
+ *          应答队列放不下一轮读取产生的应答时也不读取, 等 socket 可写把应答发出去
+ * @note    paused 只用原子操作读取, 不进入流量控制锁; 读到旧值时 mqttThread 在锁内再检查一次, 返回 MQTT_RECV_AGAIN
+ */
+static int engineReadable(EngineConn *conn)
+{
+    MqttFlow *flow = conn->broker->flow;
+
+    if(conn->ackLen / ENGINE_ACK_LEN + MQTT_ENGINE_BURST > ENGINE_ACK_QUEUE)
+        return 0;
+    return !flow || !__atomic_load_n(&flow->paused, __ATOMIC_ACQUIRE);
+}
+
+static int sockCompare(const void *a, const void *b)
+{
+    SOCKET x = ((const EngineSock*)a)->socket, y = ((const EngineSock*)b)->socket;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief   标记 select 报告可读或可写的连接
+ * @param   shard [in] 分片指针
+ * @param   set [in] select 的结果, 只剩就绪的 socket
+ * @param   flag [in] ENGINE_READ 或 ENGINE_WRITE
+ * @note    在 connLock 内调用; 逐个 FD_ISSET 要遍历整个 fd_array, 连接多时是 O(n^2), 这里对排序后的 socks 二分查找
+ */
+static void engineMark(MqttShard *shard, const fd_set *set, uint8_t flag)
+{
+    EngineSock key, *sock;
+    unsigned int i;
+
+    for(i = 0; i < set->fd_count; i++)
+    {
+        key.socket = set->fd_array[i];
+        sock = bsearch(&key, shard->socks, shard->sockCount, sizeof(EngineSock), sockCompare);
+        if(sock && sock->conn->gen == sock->gen)
+            sock->conn->ready |= flag;
+    }
+}
+
+/**
+ * @brief   连接是否还有没读完的数据, 在 mqttThread 返回后调用
+ * @param   broker [in] broker 指针
+ * @param   ret [in] 最后一次 mqttThread 的返回值
+ * @return  1 = 不用等 socket 可读, 下一轮继续读取
+ */
+static int engineMore(MqttBroker *broker, int ret)
+{
+    if(ret > 0)
+        return 1; // 达到 MQTT_ENGINE_BURST
+    // TLS 一次读入整个记录, 解密后的数据留在传输层, socket 不会再变为可读
+    return broker->transport && broker->transport->pending && broker->transport->pending(broker->conn) > 0;
+}
+
+/**
+ * @brief   分片 I/O 线程, 等待分片内所有 socket 可读, 非阻塞地调用 mqttThread 直到没有数据;
+ *          有排队应答的 socket 同时等待可写, 可写时发送应答
+ * @param   param [in] 分片指针
+ */
+static void *shardIO(void *param)
+{
+    MqttShard *shard = param;
+    EngineConn *conn;
+    MqttBroker *broker;
+    EngineDone done[MQTT_ENGINE_INFLIGHT];
+    fd_set readSet, writeSet;
+    struct timeval tv;
+    uint64_t now, sweep = 0;
+    unsigned int i, n, more, readable, writable;
+    int ret;
+
+    bindCpu(shard->cpu);
+    while(shard->run)
+    {
+        FD_ZERO(&readSet);
+        FD_ZERO(&writeSet);
+        more = 0;
+        shard->sockCount = 0;
+        EnterCriticalSection(&shard->connLock);
+        for(i = 0; i < shard->connCount; i++)
+        {
+            // 已停止读取的连接即使没读完也不加入; 它的 more 保留到恢复读取
+            // 每个连接的 socket 各不相同, 直接追加, 不用 FD_SET 逐个查重
+            conn = shard->conns[i];
+            readable = engineReadable(conn);
+            writable = conn->ackLen && !conn->ackRetry;
+            if(readable)
+            {
+                readSet.fd_array[readSet.fd_count++] = (SOCKET)conn->broker->socket;
+                more |= conn->more;
+            }
+            if(writable)
+                writeSet.fd_array[writeSet.fd_count++] = (SOCKET)conn->broker->socket;
+            if(readable || writable)
+            {
+                shard->socks[shard->sockCount].socket = (SOCKET)conn->broker->socket;
+                shard->socks[shard->sockCount].conn = conn;
+                shard->socks[shard->sockCount].gen = conn->gen;
+                shard->sockCount++;
+            }
+        }
+        LeaveCriticalSection(&shard->connLock);
+        qsort(shard->socks, shard->sockCount, sizeof(EngineSock), sockCompare);
+        // 在锁外等待, 加入和移出连接不会被推迟; 有连接没读完时不等待
+        if(!readSet.fd_count && !writeSet.fd_count)
+            Sleep(MQTT_ENGINE_POLL);
+        else
+        {
+            tv.tv_sec = 0;
+            tv.tv_usec = more ? 0 : MQTT_ENGINE_POLL * 1000;
+            if(select(0, &readSet, &writeSet, NULL, &tv) < 0)
+            {
+                FD_ZERO(&readSet); // 有 socket 在移出引擎之前就被关闭了
+                FD_ZERO(&writeSet);
+                Sleep(MQTT_ENGINE_POLL);
+            }
+        }
+        EnterCriticalSection(&shard->connLock);
+        engineMark(shard, &readSet, ENGINE_READ);
+        engineMark(shard, &writeSet, ENGINE_WRITE);
+        for(i = 0; i < shard->connCount;)
+        {
+            // 等待期间加入的连接不在 readSet 中; 移出后 socket 被复用时读到 MQTT_RECV_AGAIN;
+            // 等待期间停止读取的连接 mqttThread 也返回 MQTT_RECV_AGAIN, 不会阻塞分片
+            conn = shard->conns[i];
+            broker = conn->broker;
+            ret = MQTT_RECV_AGAIN;
+            if((conn->ready & ENGINE_WRITE) || conn->ackRetry)
+                engineFlush(conn);
+            // 有没读完的数据时不等 select, 但仍要检查是否停止读取和应答队列的空间
+            if(((conn->ready & ENGINE_READ) || conn->more) && engineReadable(conn))
+            {
+                for(n = 0; n < MQTT_ENGINE_BURST && (ret = mqttThread(broker)) > 0; n++);
+                conn->more = (ret > 0 || MQTT_RECV_AGAIN == ret) && engineMore(broker, ret);
+            }
+            conn->ready = 0;
+            if(ret <= 0 && MQTT_RECV_AGAIN != ret)
+            {
+                // 连接已关闭, 用末尾的连接补位, 补位的连接还没处理过, 所以 i 不变
+                n = engineDetach(shard, i, done);
+                free(broker->rxPacket);
+                broker->rxPacket = NULL;
+                broker->rxHeadLen = 0;
+                engineCall(broker, done, n);
+                if(shard->engine->closeCB)
+                    shard->engine->closeCB(broker, ret);
+                continue;
+            }
+            i++;
+        }
+        now = mqttTimeUs();
+        if(now >= sweep)
+        {
+            sweep = now + ENGINE_SWEEP * 1000;
+            for(i = 0; i < shard->connCount; i++)
+                engineSweep(shard, shard->conns[i], now);
+        }
+        LeaveCriticalSection(&shard->connLock);
+    }
+    return NULL;
+}
+
+/**
+ * @brief   分片任务线程, 串行执行投递到本分片的任务
+ * @param   param [in] 分片指针
+ */
+static void *shardJob(void *param)
+{
+    MqttShard *shard = param;
+    MqttEngineJob job;
+
+    bindCpu(shard->cpu);
+    for(;;)
+    {
+        EnterCriticalSection(&shard->jobLock);
+        while(shard->run && shard->jobHead == shard->jobTail)
+            SleepConditionVariableCS(&shard->jobCond, &shard->jobLock, INFINITE);
+        if(!shard->run)
+        {
+            LeaveCriticalSection(&shard->jobLock);
+            break;
+        }
+        job = shard->jobs[shard->jobHead % MQTT_ENGINE_JOB_MAX];
+        shard->jobHead++;
+        LeaveCriticalSection(&shard->jobLock);
+        job.job(job.broker, job.param);
+    }
+    return NULL;
+}
+
+/**
+ * @brief   停止分片线程并释放分片, 仍在分片中的连接被移出
+ * @param   shard [in] 分片指针
+ */
+static void shardFree(MqttShard *shard)
+{
+    EngineDone done[MQTT_ENGINE_INFLIGHT];
+    EngineConn *conn;
+    MqttBroker *broker;
+    unsigned int n;
+
+    EnterCriticalSection(&shard->jobLock);
+    shard->run = 0;
+    WakeAllConditionVariable(&shard->jobCond);
+    LeaveCriticalSection(&shard->jobLock);
+    pthread_join(shard->ioThread, NULL);
+    pthread_join(shard->jobThread, NULL);
+    while(shard->connCount)
+    {
+        broker = shard->conns[0]->broker;
+        n = engineDetach(shard, 0, done);
+        engineCall(broker, done, n);
+    }
+    while((conn = shard->freeConns))
+    {
+        shard->freeConns = conn->next;
+        free(conn);
+    }
+    DeleteCriticalSection(&shard->connLock);
+    DeleteCriticalSection(&shard->jobLock);
+    DeleteCriticalSection(&shard->ackLock);
+    free(shard);
+}
+MqttEngine *mqttEngineCreate(unsigned int shards, MqttCloseCB closeCB)
+{
+    MqttEngine *engine;
+    MqttShard *shard;
+    SYSTEM_INFO info;
+    unsigned int cpus;
+
+    GetSystemInfo(&info);
+    cpus = info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+    if(!shards)
+        shards = cpus;
+    if(shards > MQTT_ENGINE_SHARD_MAX)
+        shards = MQTT_ENGINE_SHARD_MAX;
+    engine = calloc(1, sizeof(MqttEngine));
+    if(!engine)
+        return NULL;
+    engine->closeCB = closeCB;
+    for(engine->count = 0; engine->count < shards; engine->count++)
+    {
+        shard = calloc(1, sizeof(MqttShard));
+        if(!shard)
+            break;
+        shard->engine = engine;
+        shard->cpu = engine->count % cpus;
+        shard->run = 1;
+        InitializeCriticalSection(&shard->connLock);
+        InitializeCriticalSection(&shard->jobLock);
+        InitializeConditionVariable(&shard->jobCond);
+        InitializeCriticalSection(&shard->ackLock);
+        if(pthread_create(&shard->ioThread, NULL, shardIO, shard))
+        {
+            DeleteCriticalSection(&shard->connLock);
+            DeleteCriticalSection(&shard->jobLock);
+            DeleteCriticalSection(&shard->ackLock);
+            free(shard);
+            break;
+        }
+        if(pthread_create(&shard->jobThread, NULL, shardJob, shard))
+        {
+            shard->run = 0;
+            pthread_join(shard->ioThread, NULL);
+            DeleteCriticalSection(&shard->connLock);
+            DeleteCriticalSection(&shard->jobLock);
+            DeleteCriticalSection(&shard->ackLock);
+            free(shard);
+            break;
+        }
+        engine->shards[engine->count] = shard;
+    }
+    if(engine->count < shards)
+    {
+        mqttEngineDestroy(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void mqttEngineDestroy(MqttEngine *engine)
+{
+    unsigned int i;
+
+    for(i = 0; i < engine->count; i++)
+        shardFree(engine->shards[i]);
+    free(engine);
+}
+
+int mqttEngineAdd(MqttEngine *engine, MqttBroker *broker)
+{
+    MqttShard *shard;
+    EngineConn *conn;
+    int ret = -1;
+
+    if(!broker->clientid || !broker->sendLock)
+        return -1;
+    shard = shardOf(engine, broker);
+    EnterCriticalSection(&shard->connLock);
+    if(shard->connCount < MQTT_ENGINE_CONN_MAX && !mqttSetNonblock(broker->socket, 1))
+    {
+        conn = shard->freeConns;
+        if(conn)
+            shard->freeConns = conn->next;
+        else
+            conn = calloc(1, sizeof(EngineConn));
+        if(conn)
+        {
+            conn->broker = broker;
+            conn->shard = shard;
+            conn->more = 0;
+            conn->ready = 0;
+            conn->ackRetry = 0;
+            conn->ackLen = 0;
+            conn->ackCB = broker->ackCB;
+            EnterCriticalSection(&shard->ackLock);
+            conn->gen++;
+            broker->ackCB = engineAck;
+            broker->ackSend = engineAckSend;
+            broker->nonblock = 1;
+            broker->engine = conn;
+            LeaveCriticalSection(&shard->ackLock);
+            shard->conns[shard->connCount++] = conn;
+            for(ret = 0; engine->shards[ret] != shard; ret++);
+        }
+    }
+    LeaveCriticalSection(&shard->connLock);
+    return ret;
+}
+
+void mqttEngineRemove(MqttEngine *engine, MqttBroker *broker)
+{
+    MqttShard *shard = shardOf(engine, broker);
+    EngineDone done[MQTT_ENGINE_INFLIGHT];
+    unsigned int i, n = 0;
+
+    EnterCriticalSection(&shard->connLock);
+    for(i = 0; i < shard->connCount; i++)
+    {
+        if(shard->conns[i]->broker == broker)
+        {
+            n = engineDetach(shard, i, done);
+            break;
+        }
+    }
+    LeaveCriticalSection(&shard->connLock);
+    engineCall(broker, done, n);
+}
+MqttRet mqttEngineSubmit(MqttEngine *engine, MqttBroker *broker, MqttJob job, void *param)
+{
+    MqttShard *shard;
+    MqttEngineJob *slot;
+    MqttRet ret = MQTT_OK;
+
+    if(!job || !broker->clientid)
+        return MQTT_PARAM_ERR;
+    shard = shardOf(engine, broker);
+    EnterCriticalSection(&shard->jobLock);
+    if(shard->jobTail - shard->jobHead < MQTT_ENGINE_JOB_MAX)
+    {
+        slot = &shard->jobs[shard->jobTail % MQTT_ENGINE_JOB_MAX];
+        slot->job = job;
+        slot->broker = broker;
+        slot->param = param;
+        shard->jobTail++;
+        WakeConditionVariable(&shard->jobCond);
+    }
+    else
+        ret = MQTT_MEM_ERR;
+    LeaveCriticalSection(&shard->jobLock);
+    return ret;
+}
+
+MqttRet mqttEnginePublish(MqttEngine *engine, MqttBroker *broker, const char *topic, const void *data, \
+                          uint32_t len, uint8_t retain, uint8_t qos, MqttDoneCB done, void *param)
+{
+    MqttShard *shard;
+    EngineConn *conn;
+    EnginePending *pending = NULL;
+    uint32_t gen;
+    uint16_t msgID;
+    unsigned int i;
+    MqttRet ret;
+
+    if(!qos)
+        return mqttPublishAsync(broker, topic, data, len, retain, 0, &msgID);
+    if(!broker->clientid)
+        return MQTT_PARAM_ERR;
+    shard = shardOf(engine, broker);
+    // 在发送之前登记, 应答可能在发送返回之前就被 I/O 线程收到
+    EnterCriticalSection(&shard->ackLock);
+    conn = broker->engine;
+    if(!conn)
+        ret = MQTT_PARAM_ERR;
+    else if(conn->pendingCount >= MQTT_ENGINE_INFLIGHT)
+        ret = MQTT_SIZE_ERR;
+    else
+    {
+        // 跳过仍在等待应答的消息 ID (序号回绕), 发布和订阅只在任务线程中修改 seq
+        while(!broker->seq || pendingFind(conn, broker->seq))
+            broker->seq++;
+        for(i = 0; conn->pending[i].type; i++);
+        pending = &conn->pending[i];
+        pending->type = (1 == qos) ? MQTT_MSG_PUBACK : MQTT_MSG_PUBREC;
+        pending->msgID = broker->seq;
+        pending->deadline = mqttTimeUs() + ENGINE_ACK_TIMEOUT;
+        pending->done = done;
+        pending->param = param;
+        conn->pendingCount++;
+        ret = MQTT_OK;
+    }
+    gen = conn ? conn->gen : 0;
+    LeaveCriticalSection(&shard->ackLock);
+    if(MQTT_OK != ret)
+        return ret;
+    ret = mqttPublishAsync(broker, topic, data, len, retain, qos, &msgID);
+    if(MQTT_OK != ret)
+    {
+        EnterCriticalSection(&shard->ackLock);
+        if(broker->engine == conn && conn->gen == gen && pending->type)
+        {
+            pending->type = 0;
+            conn->pendingCount--;
+        }
+        else
+            ret = MQTT_OK; // 期间连接已关闭或移出, done 已经以 MQTT_SEND_ERR 调用
+        LeaveCriticalSection(&shard->ackLock);
+    }
+    return ret;
+}
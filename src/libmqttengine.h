@@ -0,0 +1,109 @@
+#ifndef __LIBMQTTENGINE_H
+#define __LIBMQTTENGINE_H
+
+#include "libmqtt.h"
+
+// 最大分片数
+#define MQTT_ENGINE_SHARD_MAX  64
+// 每个分片最多管理的连接数
+#define MQTT_ENGINE_CONN_MAX   1024
+// 每个分片任务队列长度
+#define MQTT_ENGINE_JOB_MAX    256
+// 分片 I/O 线程 select 超时时间 (ms)
+#define MQTT_ENGINE_POLL       10
+// 每个连接最多同时等待应答的 mqttEnginePublish 数
+#define MQTT_ENGINE_INFLIGHT   64
+// 一个连接可读时最多连续处理的报文数, 避免一个繁忙的连接饿死同分片的其它连接
+#define MQTT_ENGINE_BURST      32
+
+typedef struct MqttEngine MqttEngine;
+
+/**
+ * @brief   投递到分片上执行的任务
+ * @param   broker [in] 任务所属的 broker
+ * @param   param [in] 投递任务时传入的参数
+ */
+typedef void (*MqttJob)(MqttBroker *broker, void *param);
+
+/**
+ * @brief   连接关闭回调, 在分片 I/O 线程中调用
+ * @param   broker [in] 已关闭的 broker, 此时已从引擎中移除, 加入时被替换的成员已经恢复
+ * @param   ret [in] mqttThread 的返回值
+ */
+typedef void (*MqttCloseCB)(MqttBroker *broker, int ret);
+
+/**
+ * @brief   mqttEnginePublish 完成回调, 在分片 I/O 线程中调用, 不要在其中阻塞
+ * @param   broker [in] broker 指针
+ * @param   ret [in] MQTT_OK 完成, MQTT_REASON_ERR 服务器拒绝, MQTT_ACK_ERR 超时无应答, MQTT_SEND_ERR 连接已关闭或已移出引擎
+ * @param   param [in] 发布时传入的参数
+ */
+typedef void (*MqttDoneCB)(MqttBroker *broker, MqttRet ret, void *param);
+
+/**
+ * @brief   创建多连接引擎
+ * @param   shards [in] 分片数 (0 = CPU 核心数), 每个分片包含一个 I/O 线程和一个任务线程, 绑定在同一个核心上
+ * @param   closeCB [in] 连接关闭回调, 可以为 NULL
+ * @return  引擎指针, 失败返回 NULL
+ */
+extern MqttEngine *mqttEngineCreate(unsigned int shards, MqttCloseCB closeCB);
+
+/**
+ * @brief   停止所有分片线程并释放引擎
+ * @param   engine [in] 引擎指针
+ * @warning 不会关闭 socket, 也不会执行队列中剩余的任务
+ */
+extern void mqttEngineDestroy(MqttEngine *engine);
+
+/**
+ * @brief   将 broker 加入引擎, 按 clientid 的哈希值分配到固定的分片
+ * @param   engine [in] 引擎指针
+ * @param   broker [in] broker 指针, socket 必须已经连接, 必须设置 sendLock (I/O 线程发送应答时任务线程可能正在发布)
+ * @return  分片序号, 失败返回 -1
+ * @note    socket 被设置为非阻塞模式, 由分片 I/O 线程读取, 传输层还有缓冲的数据 (MqttTransport.pending) 时不等 socket 可读继续读取;
+ *          收到消息后的 PUBACK/PUBREC/PUBCOMP 和引擎的 PUBREL 先放入该连接的队列, socket 可写时再发送, 队列满时暂停读取;
+ *          使用传输层 (WebSocket/TLS) 时队列整批发送, 仍可能等待 socket 可写;
+ *          broker->ackCB 被替换为引擎的应答处理, 原来的回调仍会被调用, 移出或关闭时恢复. 任务中调用 mqttPublish 等阻塞接口时还需要设置该连接自己的 conditionVar 和 criticalSection
+ * @warning 加入后不要再自行调用 mqttThread
+ */
+extern int mqttEngineAdd(MqttEngine *engine, MqttBroker *broker);
+
+/**
+ * @brief   将 broker 移出引擎, 未完成的 mqttEnginePublish 以 MQTT_SEND_ERR 完成
+ * @note    socket 保持非阻塞模式 (TLS 传输层要求), 之后阻塞模式的 mqttThread 在没有数据时等待 socket 可读
+ * @param   engine [in] 引擎指针
+ * @param   broker [in] broker 指针
+ * @warning 函数返回后分片 I/O 线程不会再访问 broker, 此时才可以关闭 socket
+ */
+extern void mqttEngineRemove(MqttEngine *engine, MqttBroker *broker);
+
+/**
+ * @brief   向 broker 所在分片投递任务 (线程安全)
+ * @param   engine [in] 引擎指针
+ * @param   broker [in] broker 指针
+ * @param   job [in] 任务函数, 在分片任务线程中执行, 发布消息应使用 mqttEnginePublish
+ * @param   param [in] 任务参数
+ * @return  MQTT_OK 成功, MQTT_MEM_ERR 队列已满, MQTT_PARAM_ERR 参数错误
+ * @warning 同一分片的任务串行执行; 任务中也可以调用 mqttPublish 等阻塞接口, 但等待应答期间该分片上的其它任务都被推迟
+ */
+extern MqttRet mqttEngineSubmit(MqttEngine *engine, MqttBroker *broker, MqttJob job, void *param);
+
+/**
+ * @brief   发布消息, 不等待应答, 完成时调用 done (QoS 2 的 PUBREL 由引擎发送)
+ * @param   engine [in] 引擎指针
+ * @param   broker [in] 已加入引擎的 broker 指针
+ * @param   topic [in] topic 字符串
+ * @param   data [in] 消息内容
+ * @param   len [in] 消息长度
+ * @param   retain [in] 是否启用 Retain 标志 (1 启用, 0 禁用)
+ * @param   qos [in] (0, 1, 2)
+ * @param   done [in] 完成回调, QoS 0 时不调用, 可以为 NULL
+ * @param   param [in] 回调参数
+ * @return  参考 MqttRet, 返回 MQTT_OK 时 done 恰好被调用一次, 返回其它值时不调用;
+ *          等待应答的消息达到 MQTT_ENGINE_INFLIGHT 时返回 MQTT_SIZE_ERR, broker 不在引擎中时返回 MQTT_PARAM_ERR
+ * @warning 只能在该 broker 的任务 (mqttEngineSubmit) 中调用; 超时不重传, 以 MQTT_ACK_ERR 完成
+ */
+extern MqttRet mqttEnginePublish(MqttEngine *engine, MqttBroker *broker, const char *topic, const void *data, \
+                                 uint32_t len, uint8_t retain, uint8_t qos, MqttDoneCB done, void *param);
+
+#endif // __LIBMQTTENGINE_H
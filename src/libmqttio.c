@@ -1,15 +1,64 @@
+#define _CRT_RAND_S // rand_s
+#include <stdlib.h>
 #include <windows.h>
 #include <winsock.h>
 #include "libmqtt.h"
 
+int mqttWaitSocket(void *socket, uint8_t write, unsigned int time)
+{
+    fd_set set;
+    struct timeval tv;
+
+    FD_ZERO(&set);
+    FD_SET((SOCKET)socket, &set);
+    tv.tv_sec = time / 1000;
+    tv.tv_usec = (time % 1000) * 1000;
+    return select(0, write ? NULL : &set, write ? &set : NULL, NULL, &tv);
+}
+
 int32_t mqttSend(void *socket, const void *data, unsigned int len)
 {
-    return send((SOCKET)socket, data, len, 0);
+    unsigned int total = 0;
+    int ret;
+
+    // 非阻塞 socket 的发送缓冲区满时等待可写, 保证整个报文连续发完
+    while(total < len)
+    {
+        ret = send((SOCKET)socket, (const char*)data + total, len - total, 0);
+        if(ret > 0)
+            total += ret;
+        else if(SOCKET_ERROR == ret && WSAEWOULDBLOCK == WSAGetLastError() && mqttWaitSocket(socket, 1, MQTT_TIMEOUE) > 0)
+            continue;
+        else
+            return total ? (int32_t)total : ret;
+    }
+    return total;
+}
+
+int32_t mqttSendNow(void *socket, const void *data, unsigned int len)
+{
+    int ret = send((SOCKET)socket, (const char*)data, len, 0);
+
+    // 不等待可写, 发送缓冲区满时返回 0
+    if(SOCKET_ERROR == ret && WSAEWOULDBLOCK == WSAGetLastError())
+        return 0;
+    return ret;
 }
 
 int32_t mqttRecv(void *socket, void *data, unsigned int len)
 {
-    return recv((SOCKET)socket, (char*)data, len, 0);
+    int ret = recv((SOCKET)socket, (char*)data, len, 0);
+
+    if(SOCKET_ERROR == ret && WSAEWOULDBLOCK == WSAGetLastError())
+        return MQTT_RECV_AGAIN;
+    return ret;
+}
+
+int mqttSetNonblock(void *socket, uint8_t nonblock)
+{
+    u_long mode = nonblock;
+
+    return ioctlsocket((SOCKET)socket, FIONBIO, &mode);
 }
 
 int mqttWaitAck(MqttBroker *broker, unsigned int time)
@@ -22,3 +71,64 @@ void mqttWakeUp(MqttBroker *broker)
 {
     WakeConditionVariable((CONDITION_VARIABLE*)(broker->conditionVar));
 }
+
+void mqttLock(void *lock)
+{
+    EnterCriticalSection((CRITICAL_SECTION*)lock);
+}
+
+void mqttUnlock(void *lock)
+{
+    LeaveCriticalSection((CRITICAL_SECTION*)lock);
+}
+
+int mqttTryLock(void *lock)
+{
+    return TryEnterCriticalSection((CRITICAL_SECTION*)lock) ? 1 : 0;
+}
+
+void mqttFlowLock(MqttFlow *flow)
+{
+    EnterCriticalSection((CRITICAL_SECTION*)(flow->criticalSection));
+}
+
+void mqttFlowUnlock(MqttFlow *flow)
+{
+    LeaveCriticalSection((CRITICAL_SECTION*)(flow->criticalSection));
+}
+
+void mqttFlowWait(MqttFlow *flow)
+{
+    SleepConditionVariableCS((CONDITION_VARIABLE*)(flow->conditionVar), \
+            (CRITICAL_SECTION*)(flow->criticalSection), INFINITE);
+}
+
+void mqttFlowWake(MqttFlow *flow)
+{
+    WakeAllConditionVariable((CONDITION_VARIABLE*)(flow->conditionVar));
+}
+
+void mqttRandom(void *data, unsigned int len)
+{
+    unsigned int r, i;
+    uint8_t *p = data;
+
+    while(len)
+    {
+        rand_s(&r);
+        for(i = 0; len && i < sizeof(r); i++, len--, r >>= 8)
+            *p++ = r & 0xFF;
+    }
+}
+
+uint64_t mqttTimeUs(void)
+{
+    static LARGE_INTEGER freq; // 多个线程同时初始化时写入的值相同
+    LARGE_INTEGER now;
+
+    if(!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)now.QuadPart / freq.QuadPart * 1000000 \
+           + (uint64_t)now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+}
@@ -0,0 +1,204 @@
+#ifdef MQTT_USE_TLS
+
+#include <stdint.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "libmqtttls.h"
+
+extern int mqttWaitSocket(void *socket, uint8_t write, unsigned int time);
+extern int mqttSetNonblock(void *socket, uint8_t nonblock);
+extern void mqttLock(void *lock);
+extern void mqttUnlock(void *lock);
+
+/**
+ * @brief   收到新的会话票据 (TLS 1.3 在握手之后才发送), 替换缓存的会话
+ * @return  1 = 保留 sess 的引用
+ */
+static int tlsNewSession(SSL *ssl, SSL_SESSION *sess)
+{
+    MqttTlsConfig *config = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    SSL_SESSION *old;
+
+    if(!SSL_SESSION_is_resumable(sess))
+        return 0;
+    old = __atomic_exchange_n(&config->session, sess, __ATOMIC_ACQ_REL);
+    if(old)
+        SSL_SESSION_free(old);
+    return 1;
+}
+
+MqttRet mqttTlsInit(MqttTlsConfig *config, const char *caFile, uint8_t flags)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_client_method());
+    if(!ctx)
+        return MQTT_MEM_ERR;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if(!(flags & MQTT_TLS_NO_VERIFY))
+    {
+        if(!(caFile ? SSL_CTX_load_verify_locations(ctx, caFile, NULL) : SSL_CTX_set_default_verify_paths(ctx)))
+        {
+            SSL_CTX_free(ctx);
+            return MQTT_PARAM_ERR;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // 很多服务器断开时不发送 close_notify, 当作正常关闭; 否则 OpenSSL 视为错误并使缓存的会话失效
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    // 会话由 tlsNewSession 保存在 config 中, 不使用 OpenSSL 内部的缓存
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tlsNewSession);
+    SSL_CTX_set_app_data(ctx, config);
+    config->ctx = ctx;
+    config->session = NULL;
+    config->flags = flags;
+    return MQTT_OK;
+}
+
+void mqttTlsFree(MqttTlsConfig *config)
+{
+    if(config->session)
+        SSL_SESSION_free(config->session);
+    SSL_CTX_free(config->ctx);
+    config->session = NULL;
+    config->ctx = NULL;
+}
+
+MqttRet mqttTlsConnect(MqttTls *tls, MqttTlsConfig *config, void *socket, const char *host)
+{
+    SSL_SESSION *sess, *expected = NULL;
+    SSL *ssl;
+    int ret;
+
+    if(!tls->lock)
+        return MQTT_PARAM_ERR;
+    tls->socket = socket;
+    tls->resumed = 0;
+    ssl = SSL_new(config->ctx);
+    if(!ssl)
+        return MQTT_MEM_ERR;
+    if(!SSL_set_fd(ssl, (int)(intptr_t)socket) || !SSL_set_tlsext_host_name(ssl, host) \
+       || (!(config->flags & MQTT_TLS_NO_VERIFY) && !SSL_set1_host(ssl, host)))
+    {
+        SSL_free(ssl);
+        return MQTT_MEM_ERR;
+    }
+    // 取出缓存的会话, SSL_set_session 增加引用后放回; 其它线程同时连接时只是这一次不能恢复
+    sess = __atomic_exchange_n(&config->session, NULL, __ATOMIC_ACQ_REL);
+    if(sess)
+    {
+        SSL_set_session(ssl, sess);
+        if(!__atomic_compare_exchange_n(&config->session, &expected, sess, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            SSL_SESSION_free(sess); // 期间收到了更新的票据
+    }
+    ret = SSL_connect(ssl);
+    if(ret != 1)
+    {
+        ret = SSL_get_error(ssl, ret);
+        ERR_clear_error();
+        SSL_free(ssl);
+        return (SSL_ERROR_SYSCALL == ret) ? MQTT_SEND_ERR : MQTT_SERVER_ERR;
+    }
+    // 握手在其它线程开始收发之前完成, 不需要加锁; 之后的 SSL 调用在锁内进行, 不能阻塞
+    if(mqttSetNonblock(socket, 1))
+    {
+        SSL_free(ssl);
+        return MQTT_SEND_ERR;
+    }
+    tls->ssl = ssl;
+    tls->resumed = SSL_session_reused(ssl);
+    return MQTT_OK;
+}
+
+void mqttTlsClose(MqttTls *tls)
+{
+    if(!tls->ssl)
+        return;
+    // 非阻塞 socket 上 close_notify 发不出去时直接放弃
+    mqttLock(tls->lock);
+    SSL_shutdown(tls->ssl);
+    SSL_free(tls->ssl);
+    tls->ssl = NULL;
+    mqttUnlock(tls->lock);
+}
+
+/**
+ * @brief   TLS 传输层发送
+ * @note    发送缓冲区满时在锁外等待 socket 可写, 期间接收线程可以继续 SSL_read
+ */
+static int32_t tlsSend(void *conn, const void *data, unsigned int len)
+{
+    MqttTls *tls = conn;
+    size_t n;
+    int err;
+
+    if(!len)
+        return 0;
+    for(;;)
+    {
+        mqttLock(tls->lock);
+        err = SSL_ERROR_NONE;
+        if(SSL_write_ex(tls->ssl, data, len, &n) <= 0)
+        {
+            err = SSL_get_error(tls->ssl, 0);
+            ERR_clear_error();
+        }
+        mqttUnlock(tls->lock);
+        if(SSL_ERROR_NONE == err)
+            return n;
+        // 等待可写 (或重新协商时可读) 后以相同参数重试
+        if((SSL_ERROR_WANT_WRITE != err && SSL_ERROR_WANT_READ != err) \
+           || mqttWaitSocket(tls->socket, SSL_ERROR_WANT_WRITE == err, MQTT_TIMEOUE) <= 0)
+            return -1;
+    }
+}
+
+/**
+ * @brief   TLS 传输层接收
+ */
+static int32_t tlsRecv(void *conn, void *data, unsigned int len)
+{
+    MqttTls *tls = conn;
+    size_t n;
+    int err;
+
+    mqttLock(tls->lock);
+    err = SSL_ERROR_NONE;
+    if(SSL_read_ex(tls->ssl, data, len, &n) <= 0)
+    {
+        err = SSL_get_error(tls->ssl, 0);
+        ERR_clear_error();
+    }
+    mqttUnlock(tls->lock);
+    if(SSL_ERROR_NONE == err)
+        return n;
+    if(SSL_ERROR_WANT_READ == err || SSL_ERROR_WANT_WRITE == err)
+        return MQTT_RECV_AGAIN; // 还没有收到完整的记录
+    return (SSL_ERROR_ZERO_RETURN == err) ? 0 : -1; // 收到 close_notify 视为连接关闭
+}
+
+/**
+ * @brief   已解密但还没有读取的字节数
+ * @note    SSL_read 一次从 socket 读入整个记录, 剩下的数据留在 OpenSSL 中, socket 不会因此可读
+ */
+static int32_t tlsPending(void *conn)
+{
+    MqttTls *tls = conn;
+    int32_t ret;
+
+    mqttLock(tls->lock);
+    ret = SSL_pending(tls->ssl);
+    mqttUnlock(tls->lock);
+    return ret;
+}
+
+const MqttTransport mqttTlsTransport = {
+    tlsSend,
+    tlsRecv,
+    tlsPending
+};
+
+#endif // MQTT_USE_TLS
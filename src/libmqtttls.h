@@ -0,0 +1,73 @@
+#ifndef __LIBMQTTTLS_H
+#define __LIBMQTTTLS_H
+
+#include "libmqtt.h"
+
+// mqttTlsInit 选项
+#define MQTT_TLS_NO_VERIFY     (1 << 0)  // 不验证服务器证书, 只用于测试
+
+/**
+ * TLS 配置, 连接同一服务器的所有 TLS 连接共用一份 (线程安全)
+ * 保存最近一次收到的会话票据, 重新连接时用于会话恢复, 握手只需一个往返
+ */
+typedef struct
+{
+    void *ctx;               // SSL_CTX
+    void *session;           // 缓存的 SSL_SESSION, 只通过原子操作访问
+    uint8_t flags;
+} MqttTlsConfig;
+
+/**
+ * TLS 连接 (需要定义 MQTT_USE_TLS 并链接 OpenSSL)
+ * 使用方法: 设置 lock 后调用 mqttTlsConnect, 成功后令 broker->transport = &mqttTlsTransport, broker->conn 指向本结构
+ * 加解密都在 OpenSSL 的记录层中进行, 不使用 Linux 内核 TLS: 底层 I/O (libmqttio.c) 只实现了 Winsock
+ */
+typedef struct
+{
+    void *ssl;               // SSL
+    void *socket;            // 已建立的 TCP 连接
+    uint8_t resumed;         // 1 = 本次握手恢复了缓存的会话
+    // 以下成员根据平台对锁的要求增减
+    // 由用户设置 (可重入, 如 CRITICAL_SECTION), 接收线程和发送线程不能同时调用同一个 SSL 对象, 所有 SSL 调用都在锁内进行
+    void *lock;
+} MqttTls;
+
+// TLS 传输层
+extern const MqttTransport mqttTlsTransport;
+
+/**
+ * @brief   初始化 TLS 配置
+ * @param   config [out] TLS 配置
+ * @param   caFile [in] CA 证书文件 (PEM), NULL 时使用系统默认的证书
+ * @param   flags [in] 0 或 MQTT_TLS_NO_VERIFY
+ * @return  MQTT_OK 成功, MQTT_MEM_ERR 内存不足, MQTT_PARAM_ERR 证书加载失败
+ */
+extern MqttRet mqttTlsInit(MqttTlsConfig *config, const char *caFile, uint8_t flags);
+
+/**
+ * @brief   释放 TLS 配置和缓存的会话
+ * @warning 使用该配置的连接必须都已关闭
+ */
+extern void mqttTlsFree(MqttTlsConfig *config);
+
+/**
+ * @brief   完成 TLS 握手, 有缓存的会话时尝试恢复
+ * @param   tls [out] TLS 连接
+ * @param   config [in] TLS 配置
+ * @param   socket [in] 已建立的 TCP 连接
+ * @param   host [in] 服务器名称, 用于 SNI 和证书验证
+ * @return  MQTT_OK 成功, MQTT_MEM_ERR 内存不足, MQTT_SEND_ERR socket 错误, MQTT_SERVER_ERR 握手失败或证书验证失败,
+ *          MQTT_PARAM_ERR 没有设置 tls->lock
+ * @note    握手完成后 tls->resumed 表示是否恢复了会话;
+ *          socket 被设置为非阻塞模式, 在锁内的 SSL 调用不会阻塞, 阻塞模式的 mqttThread 在没有数据时等待 socket 可读
+ */
+extern MqttRet mqttTlsConnect(MqttTls *tls, MqttTlsConfig *config, void *socket, const char *host);
+
+/**
+ * @brief   发送 close_notify 并释放 TLS 连接
+ * @param   tls [in] TLS 连接
+ * @warning 随后需要关闭 socket 连接
+ */
+extern void mqttTlsClose(MqttTls *tls);
+
+#endif // __LIBMQTTTLS_H
@@ -0,0 +1,150 @@
+#include "libmqtt.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief   计算开头连续的 "普通" 字节数, 普通字节指 0x01 ~ 0x7F 中除 '+' 和 '#' 以外的字节,
+ *          这些字节既是合法的 UTF-8 又不需要检查通配符规则, 可以整块跳过
+ * @param   p [in] 数据
+ * @param   len [in] 数据长度
+ * @return  普通字节数, 不足一个向量宽度的尾部不处理, 由调用者逐字节检查
+ */
+static uint32_t plainSpan(const uint8_t *p, uint32_t len)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i plus = _mm256_set1_epi8('+');
+    const __m256i hash = _mm256_set1_epi8('#');
+    __m256i v, bad;
+    uint32_t mask;
+
+    for(; i + 32 <= len; i += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i*)(p + i));
+        // 有符号比较: 0x00 和 0x80 ~ 0xFF 都不大于 0
+        bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, plus), _mm256_cmpeq_epi8(v, hash));
+        bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_cmpgt_epi8(v, zero), _mm256_set1_epi8(-1)));
+        mask = (uint32_t)_mm256_movemask_epi8(bad);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i hash = _mm_set1_epi8('#');
+    __m128i v, bad;
+    uint32_t mask;
+
+    for(; i + 16 <= len; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i*)(p + i));
+        // 有符号比较: 0x00 和 0x80 ~ 0xFF 都不大于 0
+        bad = _mm_or_si128(_mm_cmpeq_epi8(v, plus), _mm_cmpeq_epi8(v, hash));
+        bad = _mm_or_si128(bad, _mm_xor_si128(_mm_cmpgt_epi8(v, zero), _mm_set1_epi8(-1)));
+        mask = (uint32_t)_mm_movemask_epi8(bad);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const int8x16_t zero = vdupq_n_s8(0);
+    uint8x16_t v, ok;
+
+    for(; i + 16 <= len; i += 16)
+    {
+        v = vld1q_u8(p + i);
+        ok = vcgtq_s8(vreinterpretq_s8_u8(v), zero);
+        ok = vandq_u8(ok, vmvnq_u8(vceqq_u8(v, vdupq_n_u8('+'))));
+        ok = vandq_u8(ok, vmvnq_u8(vceqq_u8(v, vdupq_n_u8('#'))));
+        if(vminvq_u8(ok) != 0xFF)
+            break; // 块内的具体位置交给逐字节检查
+    }
+#else
+    (void)p;
+    (void)len;
+#endif
+    return i;
+}
+
+/**
+ * @brief   检查一个多字节 UTF-8 字符 (首字节 >= 0x80)
+ * @param   p [in] 字符起始位置
+ * @param   len [in] 剩余长度
+ * @return  字符占用的字节数, 0 = 非法 (过长编码, 代理区, 超出 U+10FFFF 或被截断)
+ */
+static uint32_t utf8Char(const uint8_t *p, uint32_t len)
+{
+    uint8_t lo = 0x80, hi = 0xBF;
+    uint32_t n, i;
+
+    if(p[0] >= 0xC2 && p[0] <= 0xDF)
+        n = 2;
+    else if(p[0] >= 0xE0 && p[0] <= 0xEF)
+    {
+        n = 3;
+        if(p[0] == 0xE0)
+            lo = 0xA0; // 过长编码
+        if(p[0] == 0xED)
+            hi = 0x9F; // U+D800 ~ U+DFFF 代理区
+    }
+    else if(p[0] >= 0xF0 && p[0] <= 0xF4)
+    {
+        n = 4;
+        if(p[0] == 0xF0)
+            lo = 0x90; // 过长编码
+        if(p[0] == 0xF4)
+            hi = 0x8F; // 超出 U+10FFFF
+    }
+    else
+        return 0;
+    if(len < n || p[1] < lo || p[1] > hi)
+        return 0;
+    for(i = 2; i < n; i++)
+    {
+        if((p[i] & 0xC0) != 0x80)
+            return 0;
+    }
+    return n;
+}
+
+int mqttCheckTopic(const uint8_t *topic, uint32_t len, uint8_t filter)
+{
+    uint32_t i, n;
+
+    // topic 名称和过滤器都至少包含一个字符, 长度不能超过 UTF-8 字符串长度字段的上限
+    if(!len || len > 0xFFFF)
+        return 0;
+    for(i = 0; i < len; i += n)
+    {
+        i += plainSpan(topic + i, len - i);
+        if(i >= len)
+            break;
+        n = 1;
+        switch(topic[i])
+        {
+        case 0x00:
+            return 0; // 不允许 U+0000
+        case '+':
+            // 单层通配符必须占据整个层级
+            if(!filter || (i && topic[i - 1] != '/') || (i + 1 < len && topic[i + 1] != '/'))
+                return 0;
+            break;
+        case '#':
+            // 多层通配符必须是最后一个字符, 且单独占据一个层级
+            if(!filter || (i && topic[i - 1] != '/') || i + 1 != len)
+                return 0;
+            break;
+        default:
+            if(topic[i] >= 0x80 && !(n = utf8Char(topic + i, len - i)))
+                return 0;
+            break;
+        }
+    }
+    return 1;
+}
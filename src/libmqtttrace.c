@@ -0,0 +1,124 @@
+#ifdef MQTT_USE_TRACE
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <windows.h>
+#include "libmqtttrace.h"
+
+extern uint64_t mqttTimeUs(void);
+
+/**
+ * 每个线程一个环形缓冲区, 只有所属线程写入, 导出时从其它线程读取
+ */
+typedef struct TraceRing
+{
+    struct TraceRing *next;
+    uint32_t tid;
+    atomic_uint_fast64_t head;   // 已写入的记录总数
+    MqttTraceRecord rec[MQTT_TRACE_RING];
+} TraceRing;
+
+// 所有线程的缓冲区, 只增加不删除
+static TraceRing *_Atomic rings;
+static _Thread_local TraceRing *local;
+
+static const char *const stageName[] = {
+    "encode",
+    "send",
+    "wait_ack",
+    "recv",
+    "callback"
+};
+
+static const char *const typeName[] = {
+    "RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+    "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "RESERVED"
+};
+
+/**
+ * @brief   分配当前线程的缓冲区并加入链表
+ * @return  缓冲区指针, 内存不足返回 NULL
+ */
+static TraceRing *traceRing(void)
+{
+    TraceRing *ring;
+
+    ring = calloc(1, sizeof(TraceRing));
+    if(!ring)
+        return NULL;
+    ring->tid = GetCurrentThreadId();
+    atomic_init(&ring->head, 0);
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while(!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release, memory_order_relaxed));
+    local = ring;
+    return ring;
+}
+
+void mqttTrace(const void *broker, uint8_t stage, uint8_t type, uint16_t msgID, uint32_t bytes)
+{
+    TraceRing *ring = local;
+    MqttTraceRecord *r;
+    uint64_t head;
+
+    if(!ring && !(ring = traceRing()))
+        return;
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    r = &ring->rec[head & (MQTT_TRACE_RING - 1)];
+    r->time = mqttTimeUs();
+    r->broker = broker;
+    r->bytes = bytes;
+    r->msgID = msgID;
+    r->type = type;
+    r->stage = stage;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * @brief   输出一个 Chrome trace 事件
+ */
+static void dumpRecord(FILE *file, uint32_t tid, const MqttTraceRecord *r, int first)
+{
+    const char *ph = "\"B\"";
+
+    if(r->stage & MQTT_TRACE_END)
+        ph = "\"E\"";
+    else if(r->stage & MQTT_TRACE_INSTANT)
+        ph = "\"i\",\"s\":\"t\""; // 瞬时事件, 作用范围为线程
+    fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"mqtt\",\"ph\":%s,\"ts\":%llu,\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"conn\":\"%p\",\"type\":\"%s\",\"id\":%u,\"bytes\":%u}}",
+            first ? "" : ",",
+            stageName[(r->stage & 0x3F) < sizeof(stageName) / sizeof(stageName[0]) ? (r->stage & 0x3F) : 0],
+            ph, (unsigned long long)r->time, tid, r->broker, typeName[r->type >> 4], r->msgID, r->bytes);
+}
+
+uint32_t mqttTraceDump(FILE *file)
+{
+    TraceRing *ring;
+    MqttTraceRecord *copy;
+    uint64_t head, start, end, i;
+    uint32_t count = 0;
+
+    copy = malloc(sizeof(MqttTraceRecord) * MQTT_TRACE_RING);
+    if(!copy)
+        return 0;
+    fprintf(file, "{\"traceEvents\":[");
+    for(ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next)
+    {
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        start = (head > MQTT_TRACE_RING) ? head - MQTT_TRACE_RING : 0;
+        for(i = start; i < head; i++)
+            copy[i & (MQTT_TRACE_RING - 1)] = ring->rec[i & (MQTT_TRACE_RING - 1)];
+        // 复制期间写线程可能已经覆盖了最旧的几条: 正在写第 end 条时第 end - MQTT_TRACE_RING 条已不可信
+        atomic_thread_fence(memory_order_acquire);
+        end = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if(end >= MQTT_TRACE_RING && start < end - MQTT_TRACE_RING + 1)
+            start = end - MQTT_TRACE_RING + 1;
+        for(i = start; i < head; i++, count++)
+            dumpRecord(file, ring->tid, &copy[i & (MQTT_TRACE_RING - 1)], !count);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    free(copy);
+    return count;
+}
+
+#endif // MQTT_USE_TRACE
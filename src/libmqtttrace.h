@@ -0,0 +1,63 @@
+#ifndef __LIBMQTTTRACE_H
+#define __LIBMQTTTRACE_H
+
+#include <stdio.h>
+#include "libmqtt.h"
+
+// 每个线程环形缓冲区的记录数, 必须是 2 的幂, 写满后覆盖最旧的记录
+#define MQTT_TRACE_RING        4096
+
+// 阶段
+#define MQTT_STAGE_ENCODE      0   // 组包和负载编码 (packetCreate)
+#define MQTT_STAGE_SEND        1   // 发送 (mqttSend 或传输层)
+#define MQTT_STAGE_WAIT        2   // 等待应答 (mqttWaitAck)
+#define MQTT_STAGE_RECV        3   // 收到一个完整报文 (瞬时事件)
+#define MQTT_STAGE_CALLBACK    4   // recvCB
+// 阶段的开始和结束, 与阶段按位或
+#define MQTT_TRACE_BEGIN       0x00
+#define MQTT_TRACE_END         0x80
+#define MQTT_TRACE_INSTANT     0x40
+
+/**
+ * 一条跟踪记录, 定长
+ */
+typedef struct
+{
+    uint64_t time;        // us, mqttTimeUs
+    const void *broker;   // 所属连接
+    uint32_t bytes;
+    uint16_t msgID;
+    uint8_t type;         // 报文类型, 如 MQTT_MSG_PUBLISH
+    uint8_t stage;        // MQTT_STAGE_xxx | MQTT_TRACE_xxx
+} MqttTraceRecord;
+
+/**
+ * 跟踪点, 定义 MQTT_USE_TRACE 时才编译进去, 否则没有任何开销
+ * 每个线程第一次记录时分配自己的环形缓冲区, 写入不加锁
+ */
+#ifdef MQTT_USE_TRACE
+#define MQTT_TRACE(broker, stage, type, msgID, bytes) mqttTrace(broker, stage, type, msgID, bytes)
+#else
+// 参数仍然经过语法检查但不求值, 整个语句被编译器删除
+#define MQTT_TRACE(broker, stage, type, msgID, bytes) do { if(0) mqttTrace(broker, stage, type, msgID, bytes); } while(0)
+#endif
+
+/**
+ * @brief   写入一条跟踪记录, 一般通过 MQTT_TRACE 调用
+ * @param   broker [in] 所属连接
+ * @param   stage [in] MQTT_STAGE_xxx | MQTT_TRACE_xxx
+ * @param   type [in] 报文类型
+ * @param   msgID [in] 消息 ID, 没有时为 0
+ * @param   bytes [in] 字节数
+ */
+extern void mqttTrace(const void *broker, uint8_t stage, uint8_t type, uint16_t msgID, uint32_t bytes);
+
+/**
+ * @brief   把所有线程缓冲区中的记录导出为 Chrome trace JSON (chrome://tracing, ui.perfetto.dev 可以打开)
+ * @param   file [in] 输出文件
+ * @return  导出的记录数
+ * @note    可以在运行中调用, 导出期间被覆盖的记录会丢弃; 线程退出后它的记录仍然保留
+ */
+extern uint32_t mqttTraceDump(FILE *file);
+
+#endif // __LIBMQTTTRACE_H
@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <string.h>
+#include "libmqttws.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// 平台相关的底层 I/O 接口, 见 libmqttio.c
+extern int32_t mqttSend(void *socket, const void *data, unsigned int len);
+extern int32_t mqttRecv(void *socket, void *data, unsigned int len);
+extern int mqttWaitSocket(void *socket, uint8_t write, unsigned int time);
+extern void mqttRandom(void *data, unsigned int len);
+extern void mqttLock(void *lock);
+extern void mqttUnlock(void *lock);
+
+#define WS_OP_CONTINUE  0x0
+#define WS_OP_BINARY    0x2
+#define WS_OP_CLOSE     0x8
+#define WS_OP_PING      0x9
+#define WS_OP_PONG      0xA
+#define WS_FIN          0x80
+#define WS_RSV          0x70
+#define WS_MASK         0x80
+
+/**
+ * @brief   计算 SHA-1 摘要, 只用于校验握手应答
+ * @param   data [in] 数据
+ * @param   len [in] 数据长度
+ * @param   digest [out] 20 字节摘要
+ */
+static void sha1(const uint8_t *data, uint32_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    uint8_t block[64];
+    uint64_t bits = (uint64_t)len * 8;
+    uint32_t i, j, done = 0, padded = 0;
+
+    while(!done)
+    {
+        // 组装 64 字节分组, 最后补 0x80, 0 和 64 位长度
+        for(i = 0; i < 64; i++)
+        {
+            if(padded + i < len)
+                block[i] = data[padded + i];
+            else if(padded + i == len)
+                block[i] = 0x80;
+            else
+                block[i] = 0;
+        }
+        if(padded + 64 > len + 8)
+        {
+            for(i = 0; i < 8; i++)
+                block[56 + i] = bits >> (56 - 8 * i);
+            done = 1;
+        }
+        padded += 64;
+
+        for(i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | \
+                   (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        for(; i < 80; i++)
+        {
+            t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (t << 1) | (t >> 31);
+        }
+        a = h[0];
+        b = h[1];
+        c = h[2];
+        d = h[3];
+        e = h[4];
+        for(j = 0; j < 80; j++)
+        {
+            if(j < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if(j < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if(j < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            t = ((a << 5) | (a >> 27)) + f + e + k + w[j];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for(i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/**
+ * @brief   Base64 编码
+ * @param   data [in] 数据
+ * @param   len [in] 数据长度
+ * @param   out [out] 编码结果, 以 0 结尾, 长度至少为 (len + 2) / 3 * 4 + 1
+ */
+static void base64(const uint8_t *data, uint32_t len, char *out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t i, v;
+
+    for(i = 0; i < len; i += 3)
+    {
+        v = (uint32_t)data[i] << 16;
+        if(i + 1 < len)
+            v |= (uint32_t)data[i + 1] << 8;
+        if(i + 2 < len)
+            v |= data[i + 2];
+        *out++ = table[(v >> 18) & 0x3F];
+        *out++ = table[(v >> 12) & 0x3F];
+        *out++ = (i + 1 < len) ? table[(v >> 6) & 0x3F] : '=';
+        *out++ = (i + 2 < len) ? table[v & 0x3F] : '=';
+    }
+    *out = 0;
+}
+
+/**
+ * @brief   用 4 字节掩码密钥异或数据
+ * @param   dst [out] 输出
+ * @param   src [in] 输入
+ * @param   len [in] 数据长度
+ * @param   key [in] 掩码密钥, 从 src[0] 开始对齐
+ */
+static void wsMask(uint8_t *dst, const uint8_t *src, uint32_t len, const uint8_t key[4])
+{
+    uint32_t i = 0, k;
+
+    memcpy(&k, key, 4); // 按内存顺序复制到每个 32 位通道, 向量宽度是 4 的倍数, 不会打乱掩码相位
+#if defined(__AVX2__)
+    const __m256i m256 = _mm256_set1_epi32(k);
+
+    for(; i + 32 <= len; i += 32)
+        _mm256_storeu_si256((__m256i*)(dst + i), \
+                            _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + i)), m256));
+#endif
+#if defined(__SSE2__)
+    const __m128i m128 = _mm_set1_epi32(k);
+
+    for(; i + 16 <= len; i += 16)
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), m128));
+#elif defined(__ARM_NEON)
+    const uint8x16_t m128 = vreinterpretq_u8_u32(vdupq_n_u32(k));
+
+    for(; i + 16 <= len; i += 16)
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), m128));
+#else
+    (void)k;
+#endif
+    for(; i < len; i++)
+        dst[i] = src[i] ^ key[i & 3];
+}
+
+/**
+ * @brief   发送全部数据, 设置了 ws->lower 时经由下层传输层发送
+ * @return  0 成功, -1 socket 错误
+ */
+static int sendAll(MqttWs *ws, const void *data, uint32_t len)
+{
+    int32_t ret;
+
+    for(; len; len -= ret, data = (const uint8_t*)data + ret)
+    {
+        ret = ws->lower ? ws->lower->send(ws->lowerConn, data, len) : mqttSend(ws->socket, data, len);
+        if(ret <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   接收数据, 设置了 ws->lower 时经由下层传输层接收
+ * @return  与 mqttRecv 相同
+ */
+static int32_t lowerRecv(MqttWs *ws, void *data, uint32_t len)
+{
+    if(ws->lower)
+        return ws->lower->recv(ws->lowerConn, data, len);
+    return mqttRecv(ws->socket, data, len);
+}
+
+/**
+ * @brief   发送一个完整的 (FIN) 帧, 负载掩码后分块发送, 帧头与第一块一起发送
+ *          整个帧在 ws->sendLock 内发送, 其它线程的帧不会插入到分块之间
+ * @param   ws [in] WebSocket 连接
+ * @param   opcode [in] 帧类型
+ * @param   data [in] 负载
+ * @param   len [in] 负载长度
+ * @return  负载长度, -1 socket 错误
+ */
+static int32_t wsSendFrame(MqttWs *ws, uint8_t opcode, const uint8_t *data, uint32_t len)
+{
+    uint8_t buf[MQTT_WS_CHUNK];
+    uint8_t key[4];
+    uint32_t head, chunk, sent;
+    int32_t ret = len;
+
+    buf[0] = WS_FIN | opcode;
+    if(len < 126)
+    {
+        buf[1] = WS_MASK | len;
+        head = 2;
+    }
+    else if(len <= 0xFFFF)
+    {
+        buf[1] = WS_MASK | 126;
+        buf[2] = len >> 8;
+        buf[3] = len & 0xFF;
+        head = 4;
+    }
+    else
+    {
+        buf[1] = WS_MASK | 127;
+        memset(buf + 2, 0, 4);
+        buf[6] = len >> 24;
+        buf[7] = (len >> 16) & 0xFF;
+        buf[8] = (len >> 8) & 0xFF;
+        buf[9] = len & 0xFF;
+        head = 10;
+    }
+    // RFC 6455 要求掩码密钥不可预测, 每帧从系统的安全随机数生成器取
+    mqttRandom(key, sizeof(key));
+    memcpy(buf + head, key, 4);
+    head += 4;
+    sent = 0;
+    mqttLock(ws->sendLock);
+    do
+    {
+        // 除最后一块外, 每块长度都是 4 的倍数, 下一块仍从掩码第 0 字节开始
+        chunk = (MQTT_WS_CHUNK - head) & ~3u;
+        if(chunk > len - sent)
+            chunk = len - sent;
+        wsMask(buf + head, data + sent, chunk, key);
+        if(sendAll(ws, buf, head + chunk))
+        {
+            ret = -1;
+            break;
+        }
+        sent += chunk;
+        head = 0;
+    } while(sent < len);
+    mqttUnlock(ws->sendLock);
+    return ret;
+}
+
+static int32_t wsSend(void *conn, const void *data, unsigned int len)
+{
+    return wsSendFrame(conn, WS_OP_BINARY, data, len);
+}
+
+/**
+ * 分片重组: 数据帧之间的边界对上层透明, 负载直接收进调用者的缓冲区 (即 recvBuf), 不额外复制;
+ * 两个数据帧之间出现的控制帧在这里处理. 帧头和控制帧负载收到一半时保存在 ws 中, 非阻塞 socket 上
+ * 返回 MQTT_RECV_AGAIN 后下次调用继续接收. 违反 RFC 6455 5.2/5.4 的帧 (RSV 位不为 0, 分片的控制帧,
+ * 没有开头的 CONTINUATION 帧, 上一个消息没收完就开始新的数据帧) 返回 -1, 由上层关闭连接
+ */
+static int32_t wsRecv(void *conn, void *data, unsigned int len)
+{
+    MqttWs *ws = conn;
+    uint32_t need, i;
+    uint64_t n;
+    uint8_t opcode;
+    int32_t ret;
+
+    while(!ws->remain)
+    {
+        // 帧头: 2 字节, 负载长度为 126/127 时再加 2/8 字节扩展长度
+        need = 2;
+        if(ws->headLen >= 2)
+            need += ((ws->head[1] & 0x7F) == 126) ? 2 : ((ws->head[1] & 0x7F) == 127) ? 8 : 0;
+        if(ws->headLen < need)
+        {
+            if((ret = lowerRecv(ws, ws->head + ws->headLen, need - ws->headLen)) <= 0)
+                return ret;
+            ws->headLen += ret;
+            continue;
+        }
+        opcode = ws->head[0] & 0x0F;
+        if(ws->head[1] & WS_MASK)
+            return -1; // 服务器发送的帧不允许带掩码
+        if(ws->head[0] & WS_RSV)
+            return -1; // 没有协商扩展, RSV 位必须为 0
+        n = ws->head[1] & 0x7F;
+        if(need > 2)
+        {
+            for(i = 2, n = 0; i < need; i++)
+                n = (n << 8) | ws->head[i];
+        }
+        if(opcode & 0x08)
+        {
+            // 控制帧不能分片
+            if(n > sizeof(ws->ctrl) || !(ws->head[0] & WS_FIN))
+                return -1;
+            if(ws->ctrlLen < n)
+            {
+                if((ret = lowerRecv(ws, ws->ctrl + ws->ctrlLen, n - ws->ctrlLen)) <= 0)
+                    return ret;
+                ws->ctrlLen += ret;
+                continue;
+            }
+            ws->headLen = ws->ctrlLen = 0;
+            if(WS_OP_CLOSE == opcode)
+            {
+                wsSendFrame(ws, WS_OP_CLOSE, ws->ctrl, (n >= 2) ? 2 : 0); // 回应关闭帧, 带回状态码
+                return 0;
+            }
+            if(WS_OP_PING == opcode)
+                wsSendFrame(ws, WS_OP_PONG, ws->ctrl, n);
+            continue;
+        }
+        if(opcode != WS_OP_CONTINUE && opcode != WS_OP_BINARY)
+            return -1; // MQTT 只使用二进制帧
+        if((WS_OP_CONTINUE == opcode) != ws->fragmented)
+            return -1;
+        ws->fragmented = !(ws->head[0] & WS_FIN);
+        ws->headLen = 0;
+        ws->remain = n;
+    }
+    if(len > ws->remain)
+        len = ws->remain;
+    ret = lowerRecv(ws, data, len);
+    if(ret > 0)
+        ws->remain -= ret;
+    return ret;
+}
+
+/**
+ * @brief   下层传输层已缓冲的字节数, WebSocket 本身不缓冲负载
+ */
+static int32_t wsPending(void *conn)
+{
+    MqttWs *ws = conn;
+
+    if(ws->lower && ws->lower->pending)
+        return ws->lower->pending(ws->lowerConn);
+    return 0;
+}
+
+const MqttTransport mqttWsTransport = {wsSend, wsRecv, wsPending};
+
+/**
+ * @brief   在响应头中查找字段 (字段名不区分大小写)
+ * @param   header [in] 以 0 结尾的响应头
+ * @param   name [in] 字段名
+ * @return  字段值起始位置, 未找到返回 NULL
+ */
+static const char *headerValue(const char *header, const char *name)
+{
+    size_t len = strlen(name);
+    size_t i;
+
+    for(; (header = strstr(header, "\r\n")) != NULL; )
+    {
+        header += 2;
+        for(i = 0; i < len; i++)
+        {
+            if((header[i] | 0x20) != (name[i] | 0x20))
+                break;
+        }
+        if(i == len && header[len] == ':')
+        {
+            for(header += len + 1; *header == ' '; header++);
+            return header;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief   检查字段值 (逗号分隔的列表) 中是否有指定的项, 不区分大小写
+ * @param   value [in] 字段值, 以 "\r\n" 结尾
+ * @param   token [in] 项
+ * @return  1 有, 0 没有
+ */
+static int headerToken(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    size_t i;
+
+    for(;;)
+    {
+        for(; *value == ' ' || *value == '\t'; value++);
+        for(i = 0; i < len && value[i] && (value[i] | 0x20) == (token[i] | 0x20); i++);
+        if(i == len)
+        {
+            for(value += len; *value == ' ' || *value == '\t'; value++);
+            if(*value == ',' || *value == '\r')
+                return 1;
+        }
+        for(; *value != ',' && *value != '\r'; value++)
+        {
+            if(!*value)
+                return 0;
+        }
+        if(*value++ == '\r')
+            return 0;
+    }
+}
+
+void mqttWsAccept(const char *key, char accept[29])
+{
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t buf[60], digest[20];
+
+    memcpy(buf, key, 24);
+    memcpy(buf + 24, guid, 36);
+    sha1(buf, sizeof(buf), digest);
+    base64(digest, sizeof(digest), accept);
+}
+
+MqttRet mqttWsConnect(MqttWs *ws, void *socket, const char *host, const char *path)
+{
+    char buf[MQTT_WS_HEADER_MAX + 1];
+    char key[25], accept[29];
+    uint8_t nonce[16];
+    const char *value;
+    int32_t ret;
+    int len;
+
+    if(!ws->sendLock)
+        return MQTT_PARAM_ERR;
+    ws->socket = socket;
+    ws->remain = 0;
+    ws->fragmented = 0;
+    ws->headLen = ws->ctrlLen = 0;
+    mqttRandom(nonce, sizeof(nonce));
+    base64(nonce, sizeof(nonce), key);
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n"
+                                     "Host: %s\r\n"
+                                     "Upgrade: websocket\r\n"
+                                     "Connection: Upgrade\r\n"
+                                     "Sec-WebSocket-Key: %s\r\n"
+                                     "Sec-WebSocket-Version: 13\r\n"
+                                     "Sec-WebSocket-Protocol: mqtt\r\n\r\n", path, host, key);
+    if(len <= 0 || len >= (int)sizeof(buf))
+        return MQTT_PARAM_ERR;
+    if(sendAll(ws, buf, len))
+        return MQTT_SEND_ERR;
+
+    mqttWsAccept(key, accept);
+
+    // 逐字节接收响应头, 避免读走紧随其后的 WebSocket 帧; 握手只执行一次
+    // 下层传输层可能使用非阻塞 socket (如 TLS), 没有数据时等待可读
+    for(len = 0; len < 4 || memcmp(buf + len - 4, "\r\n\r\n", 4); len++)
+    {
+        if(len >= MQTT_WS_HEADER_MAX)
+            return MQTT_SERVER_ERR;
+        while(MQTT_RECV_AGAIN == (ret = lowerRecv(ws, buf + len, 1)) && mqttWaitSocket(socket, 0, MQTT_TIMEOUE) > 0);
+        if(ret <= 0)
+            return MQTT_SEND_ERR;
+    }
+    buf[len] = 0;
+    if(strncmp(buf, "HTTP/1.1 101", 12))
+        return MQTT_SERVER_ERR;
+    // RFC 6455 4.1: 必须同意升级到 websocket
+    value = headerValue(buf, "Upgrade");
+    if(!value || !headerToken(value, "websocket"))
+        return MQTT_SERVER_ERR;
+    value = headerValue(buf, "Connection");
+    if(!value || !headerToken(value, "Upgrade"))
+        return MQTT_SERVER_ERR;
+    value = headerValue(buf, "Sec-WebSocket-Accept");
+    if(!value || strncmp(value, accept, 28))
+        return MQTT_SERVER_ERR;
+    // 服务器选择了子协议时只能是请求的 "mqtt"
+    value = headerValue(buf, "Sec-WebSocket-Protocol");
+    if(value)
+    {
+        for(len = strcspn(value, "\r"); len && value[len - 1] == ' '; len--);
+        if(len != 4 || strncmp(value, "mqtt", 4))
+            return MQTT_SERVER_ERR;
+    }
+    return MQTT_OK;
+}
+
+MqttRet mqttWsClose(MqttWs *ws)
+{
+    static const uint8_t status[] = {0x03, 0xE8}; // 1000 正常关闭
+
+    if(wsSendFrame(ws, WS_OP_CLOSE, status, sizeof(status)) < 0)
+        return MQTT_SEND_ERR;
+    return MQTT_OK;
+}
@@ -0,0 +1,64 @@
+#ifndef __LIBMQTTWS_H
+#define __LIBMQTTWS_H
+
+#include "libmqtt.h"
+
+// 握手响应头最大长度
+#define MQTT_WS_HEADER_MAX     1024
+// 发送时的掩码缓冲区大小, 超过的负载分块掩码后发送
+#define MQTT_WS_CHUNK          2048
+
+/**
+ * WebSocket 连接 (见 doc/06-WebSocket.md)
+ * 使用方法: 设置 sendLock 后调用 mqttWsConnect, 成功后令 broker->transport = &mqttWsTransport, broker->conn 指向本结构
+ * wss: 先完成 TLS 握手 (mqttTlsConnect), 再令 lower = &mqttTlsTransport, lowerConn 指向 MqttTls, 然后调用 mqttWsConnect
+ */
+typedef struct
+{
+    void *socket;     // 已建立的 TCP 连接
+    const MqttTransport *lower; // 下层传输层 (如 TLS), NULL 时直接收发 socket; 在 mqttWsConnect 之前设置
+    void *lowerConn;  // 下层传输层的连接对象
+    uint64_t remain;  // 当前数据帧还未读取的负载长度
+    uint8_t fragmented; // 1 = 数据帧还没有收到 FIN, 后面只能是 CONTINUATION 帧
+    // 帧头和控制帧负载的接收状态, 非阻塞 socket 上可能分多次收完
+    uint8_t head[10];
+    uint8_t headLen;
+    uint8_t ctrl[125];
+    uint8_t ctrlLen;
+    // 以下成员根据平台对锁的要求增减
+    // 发送锁 (可重入, 如 CRITICAL_SECTION), 由用户设置, 整个帧在锁内发送;
+    // 接收线程回应 PING/CLOSE 时也会发送, 所以必须设置, 可以与 MqttBroker.sendLock 相同
+    void *sendLock;
+} MqttWs;
+
+// WebSocket 传输层
+extern const MqttTransport mqttWsTransport;
+
+/**
+ * @brief   完成 WebSocket 握手 (子协议 "mqtt")
+ * @param   ws [in/out] WebSocket 连接, sendLock 必须已经设置, 使用下层传输层时 lower 和 lowerConn 也必须已经设置
+ * @param   socket [in] 已建立的 TCP 连接 (有下层传输层时为其底层 socket, 用于等待可读)
+ * @param   host [in] Host 请求头, 如 "broker.example.com:443"
+ * @param   path [in] 请求路径, 如 "/mqtt"
+ * @return  MQTT_OK 成功, MQTT_PARAM_ERR 参数错误或未设置 sendLock,
+ *          MQTT_SEND_ERR socket 收发错误或连接被关闭 (与 mqttConnect 相同),
+ *          MQTT_SERVER_ERR 服务器拒绝升级或应答错误 (状态码, Upgrade, Connection, Sec-WebSocket-Accept, 子协议)
+ */
+extern MqttRet mqttWsConnect(MqttWs *ws, void *socket, const char *host, const char *path);
+
+/**
+ * @brief   计算握手应答的 Sec-WebSocket-Accept = Base64(SHA-1(key + GUID)), RFC 6455 4.2.2
+ * @param   key [in] Sec-WebSocket-Key (Base64 编码的 16 字节, 24 个字符)
+ * @param   accept [out] 以 0 结尾的结果
+ */
+extern void mqttWsAccept(const char *key, char accept[29]);
+
+/**
+ * @brief   发送关闭帧
+ * @param   ws [in] WebSocket 连接
+ * @return  参考 MqttRet
+ * @warning 随后需要关闭 socket 连接
+ */
+extern MqttRet mqttWsClose(MqttWs *ws);
+
+#endif // __LIBMQTTWS_H
@@ -13,6 +13,7 @@ static int run;
 // 下面两个结构用于唤醒另一个线程
 static CRITICAL_SECTION criticalSection;
 static CONDITION_VARIABLE conditionVar;
+static CRITICAL_SECTION sendLock;
 
 static const char* const szSend[] = {
     "publish qos = 0",
@@ -29,7 +30,9 @@ static const char* const szMqttRet[] = {
     "param error",
     "memory is not enough",
     "socket error",
-    "no response"
+    "no response",
+    "reason code error",
+    "packet too large"
 };
 
 // Ctrl+C 处理
@@ -90,6 +93,7 @@ int main(int argc, char** argv)
 
     InitializeCriticalSection(&criticalSection);
     InitializeConditionVariable(&conditionVar);
+    InitializeCriticalSection(&sendLock);
 
     serverAddr.sin_family = AF_INET;
     serverAddr.sin_addr.s_addr = inet_addr("192.168.3.128");
@@ -120,6 +124,7 @@ int main(int argc, char** argv)
     broker.recvCB = recvCB;
     broker.conditionVar = &conditionVar;
     broker.criticalSection = &criticalSection;
+    broker.sendLock = &sendLock; // 接收线程发送应答, 主线程发布
 
     run = 1;
     signal(SIGINT, term);